@@ -1,11 +1,14 @@
 /* See LICENSE file for copyright and license details. */
 #include <ctype.h>
+#include <errno.h>
 #include <locale.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -24,6 +27,9 @@
 #define INTERSECT(x,y,w,h,r)  (MAX(0, MIN((x)+(w),(r).x_org+(r).width)  - MAX((x),(r).x_org)) \
                              * MAX(0, MIN((y)+(h),(r).y_org+(r).height) - MAX((y),(r).y_org)))
 #define TEXTW(X)              (drw_fontset_getwidth(drw, (X)) + lrpad)
+#ifndef MAP_POPULATE
+#define MAP_POPULATE          0
+#endif
 
 /* enums */
 enum { SchemeNorm, SchemeSel, SchemeOut, SchemeNormHighlight, SchemeSelHighlight, SchemeOutHighlight, SchemeLast }; /* color schemes */
@@ -41,6 +47,9 @@ static int inputw = 0, promptw;
 static int lrpad; /* sum of left and right padding */
 static size_t cursor;
 static struct item *items = NULL;
+static char *arena; /* stdin, which the text of the items points into */
+static size_t arenasiz;
+static int arenamapped;
 static struct item *matches, *matchend;
 static struct item *prev, *curr, *next, *sel;
 static int mon = -1, screen;
@@ -111,9 +120,11 @@ cleanup(void)
 	XUngrabKey(dpy, AnyKey, AnyModifier, root);
 	for (i = 0; i < SchemeLast; i++)
 		free(scheme[i]);
-	for (i = 0; items && items[i].text; ++i)
-		free(items[i].text);
 	free(items);
+	if (arenamapped)
+		munmap(arena, arenasiz);
+	else
+		free(arena);
 	drw_free(drw);
 	XSync(dpy, False);
 	XCloseDisplay(dpy);
@@ -694,25 +705,61 @@ paste(void)
 static void
 readstdin(void)
 {
-	char *line = NULL;
-	size_t i, itemsiz = 0, linesiz = 0;
-	ssize_t len;
-
-	/* read each line from stdin and add it to the item list */
-	for (i = 0; (len = getline(&line, &linesiz, stdin)) != -1; i++) {
-		if (i + 1 >= itemsiz) {
-			itemsiz += 256;
-			if (!(items = realloc(items, itemsiz * sizeof(*items))))
-				die("cannot realloc %zu bytes:", itemsiz * sizeof(*items));
+	struct stat st;
+	char *p, *nl, *end;
+	size_t i, n, cap = 0;
+	ssize_t r;
+
+	/*
+	 * map stdin when it is a file, unless a last line without newline
+	 * leaves no room for its NUL in the last page; the pages are all
+	 * written, so take their copies in one go
+	 */
+	if (fstat(0, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+	    lseek(0, 0, SEEK_CUR) == 0) {
+		arena = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+		             MAP_PRIVATE | MAP_POPULATE, 0, 0);
+		if (arena != MAP_FAILED) {
+			arenasiz = st.st_size;
+			arenamapped = arena[arenasiz - 1] == '\n' ||
+			              arenasiz % sysconf(_SC_PAGESIZE);
+			if (!arenamapped)
+				munmap(arena, arenasiz);
+		}
+	}
+	/* or read it in blocks doubling in size */
+	if (!arenamapped) {
+		arena = NULL;
+		for (arenasiz = 0;; arenasiz += r) {
+			if (arenasiz + 1 >= cap) {
+				cap = cap ? 2 * cap : 65536;
+				if (!(arena = realloc(arena, cap)))
+					die("cannot realloc %zu bytes:", cap);
+			}
+			if ((r = read(0, arena + arenasiz, cap - arenasiz - 1)) == 0)
+				break;
+			if (r < 0) {
+				if (errno != EINTR)
+					die("read:");
+				r = 0;
+			}
 		}
-		if (line[len - 1] == '\n')
-			line[len - 1] = '\0';
-		if (!(items[i].text = strdup(line)))
-			die("strdup:");
+	}
 
+	/* count the lines, then split them in place */
+	end = arena + arenasiz;
+	for (n = 0, p = arena; p < end && (nl = memchr(p, '\n', end - p)); p = nl + 1)
+		n++;
+	n += p < end; /* the last line has no newline */
+	if (n > 0 && !(items = malloc((n + 1) * sizeof(*items))))
+		die("cannot malloc %zu bytes:", (n + 1) * sizeof(*items));
+	for (i = 0, p = arena; i < n; i++, p = nl + 1) {
+		if (!(nl = memchr(p, '\n', end - p)))
+			nl = end;
+		*nl = '\0';
+		items[i].text = p;
 		items[i].out = 0;
 	}
-	free(line);
 	if (items)
 		items[i].text = NULL;
 	lines = MIN(lines, i);
@@ -0,0 +1,295 @@
+/* See LICENSE for license details. */
+#include <errno.h>
+#include <fcntl.h>
+#include <langinfo.h>
+#include <locale.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+char *argv0;
+#include "arg.h"
+#include "st.h"
+#include "win.h"
+
+#define CHUNKSIZ	(1 << 16)
+#define STREAMSIZ	(1 << 22)
+#define MINTIME		0.5
+
+typedef struct {
+	const char *name;
+	char *buf;
+	size_t len;
+} Stream;
+
+/* st.c globals, the defaults of config.def.h */
+char *utmp = NULL;
+char *scroll = NULL;
+char *stty_args = "stty raw pass8 nl -echo -iexten -cstopb 38400";
+char *vtiden = "\033[?6c";
+wchar_t *worddelimiters = L" ";
+int allowaltscreen = 1;
+int allowwindowops = 0;
+unsigned int osc52max = 1 << 24;
+char *termname = "st-256color";
+unsigned int tabspaces = 8;
+unsigned int histsize = 2000;
+unsigned int ttyreadmax = 1 << 20;
+double ttyreadtime = 4;
+unsigned int defaultfg = 258;
+unsigned int defaultbg = 259;
+unsigned int defaultcs = 256;
+
+/* allocations of st.c, which is built with malloc and realloc renamed */
+static unsigned long nallocs;
+
+/* a backend that draws nothing */
+void xbell(void) {}
+void xclipcopy(void) {}
+void xdrawcursor(int x, int y, Glyph g, int ox, int oy, Glyph og) {}
+void xdrawline(Line l, int x1, int y, int x2) {}
+void xfinishdraw(void) {}
+void xloadcols(void) {}
+int xsetcolorname(int x, const char *name) { return 0; }
+int xgetcolor(int x, uchar *r, uchar *g, uchar *b) { return 1; }
+void xseticontitle(char *p) {}
+void xsettitle(char *p) {}
+int xsetcursor(int cursor) { return 0; }
+void xsetmode(int set, unsigned int flags) {}
+void xsetpointermotion(int set) {}
+void xsetsel(char *str) { free(str); }
+int xstartdraw(void) { return 1; }
+void xximspot(int x, int y) {}
+
+void *
+benchmalloc(size_t len)
+{
+	nallocs++;
+	return malloc(len);
+}
+
+void *
+benchrealloc(void *p, size_t len)
+{
+	nallocs++;
+	return realloc(p, len);
+}
+
+static unsigned long seed = 1;
+
+static unsigned int
+rnd(unsigned int n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) % n;
+}
+
+static void
+put(Stream *s, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(s->buf + s->len, STREAMSIZ + CHUNKSIZ - s->len, fmt, ap);
+	va_end(ap);
+	s->len += n;
+}
+
+static void
+word(Stream *s, const char **alpha, int nalpha)
+{
+	int i, n = 1 + rnd(10);
+
+	for (i = 0; i < n; i++)
+		put(s, "%s", alpha[rnd(nalpha)]);
+}
+
+/*
+ * Build a synthetic stream resembling one kind of terminal output. Each
+ * round writes much less than CHUNKSIZ.
+ */
+static void
+generate(Stream *s)
+{
+	static const char *latin[] = {
+		"a", "b", "c", "d", "e", "i", "l", "n", "o", "r", "s", "t"
+	};
+	static const char *wide[] = {
+		"漢", "字", "日", "本", "語", "한", "국", "é", "ü", "─", "│", "┼"
+	};
+	int y, x, n;
+
+	s->buf = xmalloc(STREAMSIZ + CHUNKSIZ);
+	s->len = 0;
+	while (s->len < STREAMSIZ) {
+		if (!strcmp(s->name, "log")) {
+			/* compiler output */
+			put(s, "src/");
+			word(s, latin, LEN(latin));
+			put(s, ".c:%d:%d: warning: ", rnd(5000), rnd(80));
+			for (n = rnd(12); n > 0; n--) {
+				word(s, latin, LEN(latin));
+				put(s, " ");
+			}
+			put(s, "\r\n");
+		} else if (!strcmp(s->name, "sgr")) {
+			/* colored listings */
+			for (n = 1 + rnd(8); n > 0; n--) {
+				switch (rnd(3)) {
+				case 0:
+					put(s, "\033[01;3%dm", rnd(8));
+					break;
+				case 1:
+					put(s, "\033[38;5;%dm", rnd(256));
+					break;
+				case 2:
+					put(s, "\033[38;2;%d;%d;%dm",
+					    rnd(256), rnd(256), rnd(256));
+					break;
+				}
+				word(s, latin, LEN(latin));
+				put(s, "\033[0m  ");
+			}
+			put(s, "\r\n");
+		} else if (!strcmp(s->name, "utf8")) {
+			/* cat of text in several scripts */
+			for (n = rnd(16); n > 0; n--) {
+				if (rnd(2))
+					word(s, wide, LEN(wide));
+				else
+					word(s, latin, LEN(latin));
+				put(s, " ");
+			}
+			put(s, "\r\n");
+		} else {
+			/* full screen updates of a curses program */
+			put(s, "\033[?1049h\033[H\033[2J");
+			for (y = 1; y <= 24; y++) {
+				put(s, "\033[%d;1H\033[K", y);
+				for (x = 0; x < 8; x++) {
+					put(s, "\033[%d;%dm", 30 + rnd(8),
+					    40 + rnd(8));
+					word(s, latin, LEN(latin));
+				}
+			}
+			put(s, "\033[1;24r\033[24;1H\r\n\033[r\033[?1049l");
+		}
+	}
+}
+
+static void
+load(Stream *s)
+{
+	FILE *fp;
+	size_t n;
+
+	if (!(fp = fopen(s->name, "r")))
+		die("can't open %s: %s\n", s->name, strerror(errno));
+	s->buf = NULL;
+	s->len = 0;
+	do {
+		s->buf = xrealloc(s->buf, s->len + CHUNKSIZ);
+		n = fread(s->buf + s->len, 1, CHUNKSIZ, fp);
+		s->len += n;
+	} while (n > 0);
+	if (ferror(fp))
+		die("can't read %s: %s\n", s->name, strerror(errno));
+	fclose(fp);
+}
+
+/*
+ * Feed the stream to the terminal in chunks as ttyread() would, with a
+ * frame drawn after each, until it took MINTIME seconds.
+ */
+static void
+run(Stream *s)
+{
+	struct timespec start, now;
+	unsigned long allocs;
+	size_t off, n, total = 0;
+	double secs;
+	int keep, written;
+
+	twrite("\033c", 2, 0);
+	allocs = nallocs;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		for (off = 0, keep = 0; off < s->len; off += n) {
+			n = MIN(CHUNKSIZ - keep, s->len - off);
+			written = twrite(s->buf + off - keep, keep + n, 0);
+			keep += n - written;
+			draw();
+		}
+		total += s->len;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		secs = (now.tv_sec - start.tv_sec) +
+		       (now.tv_nsec - start.tv_nsec) / 1E9;
+	} while (secs < MINTIME);
+
+	printf("%-20s %8.1f %9.2f %9.1f\n", s->name,
+	       total / secs / 1E6, secs * 1E9 / total,
+	       (nallocs - allocs) / (total / 1E6));
+}
+
+void
+usage(void)
+{
+	die("usage: %s [-g geometry] [-s lines] [file ...]\n", argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static Stream builtin[] = {
+		{ "log" }, { "sgr" }, { "utf8" }, { "curses" }
+	};
+	Stream s;
+	int cols = 80, rows = 24, fd, i;
+
+	ARGBEGIN {
+	case 'g':
+		if (sscanf(EARGF(usage()), "%dx%d", &cols, &rows) != 2)
+			usage();
+		break;
+	case 's':
+		histsize = strtoul(EARGF(usage()), NULL, 0);
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	setlocale(LC_CTYPE, "");
+	if (strcmp(nl_langinfo(CODESET), "UTF-8"))
+		setlocale(LC_CTYPE, "C.UTF-8");
+
+	/* answers to queries are written to the tty */
+	if ((fd = open("/dev/null", O_RDWR)) < 0)
+		die("can't open /dev/null: %s\n", strerror(errno));
+	dup2(fd, 0);
+
+	tnew(MAX(cols, 1), MAX(rows, 1));
+	selinit();
+
+	printf("%-20s %8s %9s %9s\n", "stream", "MB/s", "ns/byte",
+	       "allocs/MB");
+	if (argc == 0) {
+		for (i = 0; i < LEN(builtin); i++) {
+			generate(&builtin[i]);
+			run(&builtin[i]);
+			free(builtin[i].buf);
+		}
+	}
+	for (i = 0; i < argc; i++) {
+		s.name = argv[i];
+		load(&s);
+		run(&s);
+		free(s.buf);
+	}
+
+	return 0;
+}
@@ -48,6 +48,8 @@ wchar_t* worddelimiters = L" ";
 /* selection timeouts (in milliseconds) */
 static unsigned int doubleclicktimeout = 300;
 static unsigned int tripleclicktimeout = 600;
+/* requestors reading a large selection in chunks are dropped after */
+static unsigned int incrtimeout = 10000;
 
 /* alt screens */
 int allowaltscreen = 1;
@@ -55,16 +57,41 @@ int allowaltscreen = 1;
 /* allow certain non-interactive (insecure) window operations such as:
    setting the clipboard text */
 int allowwindowops = 0;
+/* longest clipboard text accepted from OSC 52, in bytes */
+unsigned int osc52max = 1 << 24;
 
 /*
  * draw latency range in ms - from new content/keypress/etc until drawing.
  * within this range, st draws when content stops arriving (idle). mostly it's
  * near minlatency, but it waits longer for slow updates to avoid partial draw.
  * low minlatency will tear/flicker more, as it can "detect" idle too early.
+ * the idle period actually waited for follows the pauses in the output,
+ * from minlatency/8 to minlatency.
  */
 static double minlatency = 8;
 static double maxlatency = 33;
 
+/*
+ * parse the tty output in a thread of its own, so that keys are handled and
+ * frames drawn while a flood of output is parsed.
+ */
+static int parsethread = 0;
+
+/*
+ * lines of scrollback history, can be changed with -s. Only the newest
+ * lines are kept as cells, older ones are stored compressed.
+ */
+unsigned int histsize = 2000;
+
+/*
+ * tty read coalescing: while the child keeps writing, st keeps reading until
+ * ttyreadmax bytes are buffered or ttyreadtime ms have passed, and only then
+ * parses them. Send SIGUSR1 to print the number of bytes per wakeup, with
+ * the other statistics.
+ */
+unsigned int ttyreadmax = 1 << 20;
+double ttyreadtime = 4;
+
 /*
  * blinking timeout (set to 0 to disable blinking) for the terminal blinking
  * attribute.
@@ -177,6 +204,12 @@ unsigned int defaultunderline = 7;
 static unsigned int cursorstyle = 1;
 static Rune stcursor = 0x2603; /* snowman ("☃") */
 
+/*
+ * Fallback fonts looked up in the background at startup, for the runes
+ * here the font doesn't have: box drawing, CJK, kana, hangul and emoji.
+ */
+static Rune prewarm[] = { 0x2500, 0x4E00, 0x3042, 0xAC00, 0x1F600 };
+
 /*
  * Default columns and rows numbers
  */
@@ -235,6 +268,8 @@ static Shortcut shortcuts[] = {
     { TERMMOD, XK_Y, selpaste, { .i = 0 } },
     { ShiftMask, XK_Insert, selpaste, { .i = 0 } },
     { TERMMOD, XK_Num_Lock, numlock, { .i = 0 } },
+    { TERMMOD, XK_F, searchstart, { .i = 0 } },
+    { TERMMOD, XK_R, searchstart, { .i = 1 } },
     { ShiftMask, XK_Page_Up, kscrollup, { .i = -1 } },
     { ShiftMask, XK_Page_Down, kscrolldown, { .i = -1 } },
 };
@@ -0,0 +1,130 @@
+# Generate width.h from the Unicode Character Database:
+#
+#	awk -f mkwidth.awk EastAsianWidth.txt emoji-data.txt UnicodeData.txt
+#
+# The widths are 2 for East Asian Wide and Fullwidth characters and for
+# emoji presented as such, 0 for combining marks, format characters
+# other than the soft hyphen and the prepended concatenation marks and
+# Hangul medial and final jamo, -1 for control characters and 1 for all
+# the rest. They are stored 4 to a byte, in blocks of 256 code points
+# of which the identical ones are shared.
+
+function hex(s,   i, n)
+{
+	n = 0
+	for (i = 1; i <= length(s); i++)
+		n = n * 16 + index("0123456789ABCDEF", toupper(substr(s, i, 1))) - 1
+	return n
+}
+
+# set t[a..b] for the code points of a field like 0000..001F or 00AD
+function range(t, s, v,   a, b, i)
+{
+	gsub(/[ \t]/, "", s)
+	if ((i = index(s, "..")) > 0) {
+		a = hex(substr(s, 1, i - 1))
+		b = hex(substr(s, i + 2))
+	} else {
+		a = b = hex(s)
+	}
+	for (i = a; i <= b; i++)
+		t[i] = v
+}
+
+BEGIN {
+	FS = ";"
+	# unassigned code points of these ranges are wide
+	range(eaw, "3400..4DBF", 2)
+	range(eaw, "4E00..9FFF", 2)
+	range(eaw, "F900..FAFF", 2)
+	range(eaw, "20000..2FFFD", 2)
+	range(eaw, "30000..3FFFD", 2)
+	# medial and final jamo combine with the preceding initial
+	range(cat, "1160..11FF", 0)
+	range(cat, "D7B0..D7FF", 0)
+	# format characters which are shown
+	range(shown, "00AD", 1)
+	range(shown, "0600..0605", 1)
+	range(shown, "06DD", 1)
+	range(shown, "070F", 1)
+	range(shown, "0890..0891", 1)
+	range(shown, "08E2", 1)
+	range(shown, "110BD", 1)
+	range(shown, "110CD", 1)
+}
+
+FILENAME ~ /EastAsianWidth/ && FNR == 1 {
+	if (match($0, /[0-9]+\.[0-9]+\.[0-9]+/))
+		version = substr($0, RSTART, RLENGTH)
+}
+
+/^#/ || NF < 2 {
+	next
+}
+
+FILENAME ~ /EastAsianWidth/ {
+	split($2, f, "#")
+	gsub(/[ \t]/, "", f[1])
+	range(eaw, $1, f[1] == "W" || f[1] == "F" ? 2 : 1)
+	next
+}
+
+FILENAME ~ /emoji-data/ {
+	split($2, f, "#")
+	gsub(/[ \t]/, "", f[1])
+	if (f[1] == "Emoji_Presentation")
+		range(eaw, $1, 2)
+	next
+}
+
+FILENAME ~ /UnicodeData/ {
+	if ($3 == "Cc")
+		range(cat, $1, 3)
+	else if (($3 == "Mn" || $3 == "Me" || $3 == "Cf") &&
+	         !(hex($1) in shown))
+		range(cat, $1, 0)
+}
+
+END {
+	if (version == "") {
+		print "mkwidth.awk: no version in EastAsianWidth.txt" > "/dev/stderr"
+		exit 1
+	}
+	nblk = 0
+	for (b = 0; b < 4352; b++) {
+		s = ""
+		for (i = 0; i < 64; i++) {
+			v = 0
+			for (j = 3; j >= 0; j--) {
+				u = b * 256 + i * 4 + j
+				w = (u in cat) ? cat[u] : (u in eaw) ? eaw[u] : 1
+				v = v * 4 + w
+			}
+			s = s sprintf("0x%02x,%s", v, i % 8 == 7 ? "\n" : " ")
+		}
+		if (!(s in blkid)) {
+			blkid[s] = nblk
+			blk[nblk++] = s
+		}
+		idx[b] = blkid[s]
+	}
+
+	printf("/* generated by mkwidth.awk from the Unicode %s ", version)
+	printf("character database */\n\n")
+	printf("#define UNICODE_VERSION \"%s\"\n\n", version)
+	printf("static const %s widthidx[4352] = {\n",
+	       nblk > 256 ? "ushort" : "uchar")
+	for (b = 0; b < 4352; b++)
+		printf("%s%d,%s", b % 16 ? "" : "\t", idx[b],
+		       b % 16 == 15 ? "\n" : " ")
+	printf("};\n\n")
+	printf("static const uchar widthblk[%d][64] = {\n", nblk)
+	for (i = 0; i < nblk; i++) {
+		s = blk[i]
+		gsub(/\n/, "\n\t\t", s)
+		sub(/\t\t$/, "", s)
+		gsub(/ \n/, "\n", s)
+		printf("\t{\n\t\t%s\t},\n", s)
+	}
+	printf("};\n")
+}
@@ -3,7 +3,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <regex.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,11 +16,14 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
+#include <wctype.h>
 
 #include "st.h"
 #include "win.h"
+#include "width.h"
 
 #if   defined(__linux)
  #include <pty.h>
@@ -28,6 +33,11 @@
  #include <libutil.h>
 #endif
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+ #define X86_SIMD
+ #include <immintrin.h>
+#endif
+
 /* Arbitrary sizes */
 #define UTF_INVALID   0xFFFD
 #define UTF_SIZ       4
@@ -35,7 +45,13 @@
 #define ESC_ARG_SIZ   16
 #define STR_BUF_SIZ   ESC_BUF_SIZ
 #define STR_ARG_SIZ   ESC_ARG_SIZ
-#define HISTSIZE      2000
+#define RUN_SIZ       1024
+#define SELCHUNK      (1 << 16)
+#define SEARCH_SIZ    256
+#define HISTHOT       128
+#define BLOCK_SIZ     65536
+#define PEN_MAX       65536
+#define PEN_FREE      0xFFFFFFFF
 
 /* macros */
 #define IS_SET(flag)		((term.mode & (flag)) != 0)
@@ -43,9 +59,13 @@
 #define ISCONTROLC1(c)		(BETWEEN(c, 0x80, 0x9f))
 #define ISCONTROL(c)		(ISCONTROLC0(c) || ISCONTROLC1(c))
 #define ISDELIM(u)		(u && wcschr(worddelimiters, u))
-#define TLINE(y)		((y) < term.scr ? term.hist[((y) + term.histi - \
-				term.scr + HISTSIZE + 1) % HISTSIZE] : \
+#define TLINE(y)		((y) < term.scr ? thistline(term.scr - (y)) : \
 				term.line[(y) - term.scr])
+/*
+ * The lines of the screens have a cell past the last column, counting
+ * their blinking cells, which goes with them as they move.
+ */
+#define TBLINKS(l)		((l)[term.col].u)
 
 enum term_mode {
 	MODE_WRAP        = 1 << 0,
@@ -95,6 +115,11 @@ typedef struct {
 	char state;
 } TCursor;
 
+/* Columns x1 up to x2 of a line, none if x1 >= x2 */
+typedef struct {
+	int x1, x2;
+} Span;
+
 typedef struct {
 	int mode;
 	int type;
@@ -111,21 +136,122 @@ typedef struct {
 	} nb, ne, ob, oe;
 
 	int alt;
+	Span *rows;  /* columns selected in each row, from nb and ne */
 } Selection;
 
+/* Bits of the pairs of runes in a row, see sigput() */
+typedef struct {
+	uint64_t w[2];
+} Sig;
+
+enum search_status {
+	SEARCH_OK,
+	SEARCH_NOTFOUND,
+	SEARCH_BADREGEX
+};
+
+/*
+ * Rows are numbered for the search from the first ever pushed to the
+ * history: the history row k is pushed - k and the screen row y is
+ * pushed + y. The signatures of the history rows lo up to hi are kept
+ * in sig[n % cap]. They are only taken by the searches, of the rows
+ * pushed since the last one and of the older ones they come by.
+ */
+typedef struct {
+	int active;
+	int regex;
+	int icase;    /* the query has no upper case letter */
+	int status;
+	Rune q[SEARCH_SIZ];
+	int qlen;
+	regex_t re;
+	int recomp;   /* re is compiled */
+	Sig qsig;     /* bits every row with a match has */
+	uint64_t pushed, lo, hi;
+	Sig *sig;
+	size_t cap;
+	int scr;      /* where the view was */
+	uint64_t origin; /* bottom row of the view when the search started */
+	int found;
+	uint64_t at;  /* the match, columns x1 up to x2 of row at */
+	int x1, x2;
+	/* the row being searched */
+	Rune *text;
+	int *cols;    /* column of text[i] */
+	char *utf;
+	int *runeof;  /* index in text of utf[i] */
+	Span *m;      /* matches */
+	int textcap;
+} Search;
+
+/* Storage for compressed history lines, freed when all of them are dropped */
+typedef struct HistBlock {
+	struct HistBlock *next;
+	size_t size;  /* size of buf */
+	size_t len;   /* bytes used in buf */
+	int n;        /* lines stored */
+	int dropped;  /* lines dropped from the history */
+	uchar buf[];
+} HistBlock;
+
+/* A history row of a logical line laid out at the current width */
+typedef struct {
+	ulong seq;    /* first compressed line of the logical line */
+	int off;      /* first cell of the row in the logical line */
+} HistRow;
+
 /* Internal representation of the screen */
 typedef struct {
 	int row;      /* nb row */
 	int col;      /* nb col */
-	Line *line;   /* screen */
+	Line *line;   /* screen, &ring[base] or alt */
 	Line *alt;    /* alternate screen */
-	Line hist[HISTSIZE]; /* history buffer */
-	int histi;    /* history index */
+	/*
+	 * The main screen and the newest history lines share one ring of
+	 * hot + row lines. The screen starts at base, the history lines
+	 * precede it. The ring is stored twice in a row so that any row
+	 * lines from base on are contiguous. History slots are allocated
+	 * on first use.
+	 */
+	Line *ring;
+	int base;     /* ring index of the first screen line */
+	int hot;      /* history lines kept in the ring */
+	int histn;    /* history lines, up to histsize */
+	/*
+	 * History lines are also compressed, see linepack(), and appended
+	 * to a list of blocks once histsize exceeds hot. Compressed line
+	 * number seq is at cold[seq % coldcap].
+	 */
+	HistBlock *blkhead, *blktail;
+	uchar **cold;
+	int coldn;    /* compressed lines kept */
+	int coldcap;
+	ulong coldseq; /* lines ever compressed */
+	Line *cache;  /* decompressed lines, row + 1 of them */
+	ulong *cacheseq; /* seq + 1 of the line in cache[seq % (row + 1)] */
+	/*
+	 * Lines compressed before rfseq were written at another width. The
+	 * rows they make at the current width are only laid out when they
+	 * are scrolled to. rf holds the rows laid out so far, newest first,
+	 * going back to the line rfnext.
+	 */
+	ulong rfseq;
+	ulong rfnext;
+	HistRow *rf;
+	int rfn, rfcap;
+	Glyph *lbuf;  /* logical line being laid out */
+	int lbuflen, lbufcap;
+	ulong lbufseq; /* seq + 1 of the first line in lbuf */
 	int scr;      /* scroll back */
-	int *dirty;   /* dirtyness of lines */
+	Span *dirty;  /* dirty columns of lines */
 	TCursor c;    /* cursor */
-	int ocx;      /* old cursor col */
-	int ocy;      /* old cursor row */
+	TCursor sc[2]; /* saved cursors of both screens */
+	Pen *pens;    /* interned color pairs, pen 0 is the default pair */
+	ushort *penhash; /* open addressing table of pens, 0 is empty */
+	int npens;    /* pens ever allocated */
+	int pencap;   /* size of pens, penhash has twice as many slots */
+	ushort penfree; /* first free pen, chained through its bg */
+	Span pendirty; /* pens changed since the last snapshot */
 	int top;      /* top    scroll limit */
 	int bot;      /* bottom scroll limit */
 	int mode;     /* terminal mode flags */
@@ -137,6 +263,22 @@ typedef struct {
 	Rune lastc;   /* last printed char outside of sequence, 0 if control */
 } Term;
 
+/*
+ * What is drawn, copied from the terminal in draw() so that the parser
+ * thread can go on while it is drawn. Only what is dirty is copied.
+ */
+typedef struct {
+	Line *line;   /* the rows of the view, selected cells marked */
+	Span *dirty;  /* columns copied but not drawn yet */
+	int row, col;
+	Pen *pens;    /* the pen table */
+	int pencap;
+	int cx, cy;   /* cursor */
+	Glyph cg;     /* cell under the cursor */
+	int cursor;   /* the cursor is in the view */
+	int ocx, ocy; /* cursor drawn last */
+} Snapshot;
+
 /* CSI Escape sequence structs */
 /* ESC '[' [[ [<priv>] <arg> [;]] <mode> [<mode>]] */
 typedef struct {
@@ -146,8 +288,51 @@ typedef struct {
 	int arg[ESC_ARG_SIZ];
 	int narg;              /* nb of args */
 	char mode[2];
+	int state;             /* of the parser, see csiput() */
 } CSIEscape;
 
+/* CSI parser states and the classes of the bytes it reads */
+enum csi_state {
+	CSI_ENTRY,             /* nothing read yet */
+	CSI_PARAM,             /* reading arguments */
+	CSI_MODE,              /* mode[0] read */
+	CSI_IGNORE,            /* mode[0] and mode[1] read */
+};
+
+enum csi_class {
+	CC_DIGIT,
+	CC_SEP,                /* ; */
+	CC_PRIV,               /* ? */
+	CC_OTHER,
+	CC_FINAL,              /* 0x40 - 0x7E */
+};
+
+enum csi_action {
+	CA_NONE,
+	CA_DIGIT,
+	CA_SEP,
+	CA_PRIV,
+	CA_MODE0,
+	CA_MODE1,
+};
+
+enum base64_state {
+	B64_OFF,
+	B64_ON,
+	B64_END,     /* padding seen, the rest is ignored */
+	B64_TOOLONG, /* more than osc52max bytes */
+};
+
+/* base64 decoded as it arrives */
+typedef struct {
+	char *buf;             /* decoded bytes */
+	size_t siz;            /* allocation size */
+	size_t len;            /* decoded length */
+	uint32_t bits;         /* digits of an incomplete group */
+	int n;                 /* nb of them */
+	int state;
+} Base64;
+
 /* STR Escape sequence structs */
 /* ESC type [[ [<priv>] <arg> [;]] <mode>] ESC '\' */
 typedef struct {
@@ -157,17 +342,23 @@ typedef struct {
 	size_t len;            /* raw string length */
 	char *args[STR_ARG_SIZ];
 	int narg;              /* nb of args */
+	int nsemi;             /* ';' in buf, counted up to 2 */
+	Base64 b64;            /* the text of OSC 52, which is not in buf */
 } STREscape;
 
 static void execsh(char *, char **);
 static void stty(char **);
 static void sigchld(int);
 static void ttywriteraw(const char *, size_t);
+static size_t ttywritenb(const char *, size_t);
 
 static void csidump(void);
 static void csihandle(void);
-static void csiparse(void);
+static int csiput(Rune);
 static void csireset(void);
+static int tcsirun(const Rune *, int);
+static int tstrrun(const Rune *, int);
+static void tstrput(const char *, size_t);
 static void osc_color_response(int, int, int);
 static int eschandle(uchar);
 static void strdump(void);
@@ -181,6 +372,9 @@ static void tdumpline(int);
 static void tdump(void);
 static void tclearregion(int, int, int, int);
 static void tcursor(int);
+static uint penhashidx(uint32_t, uint32_t);
+static void penrehash(void);
+static int pengc(void);
 static void tdeletechar(int);
 static void tdeleteline(int);
 static void tinsertblank(int);
@@ -191,17 +385,34 @@ static void tmoveato(int, int);
 static void tnewline(int);
 static void tputtab(int);
 static void tputc(Rune);
+static void tputrun(const Rune *, int);
 static void treset(void);
 static void tscrollup(int, int, int);
-static void tscrolldown(int, int, int);
+static void tscrolldown(int, int);
+static void tscrollhist(int);
+static Line thistpush(Line);
+static Line thistline(int);
+static void thistpack(const Glyph *, int);
+static void thisttrunc(int);
+static int thistreflow(void);
+static void thistload(ulong);
+static size_t linepack(uchar *, const Glyph *, int);
+static void lineunpack(Glyph *, int, const uchar *);
+static ulong linevarint(const uchar **);
+static Glyph *tlinegrow(int);
+static int tlinebreak(const Glyph *, int, int, int);
+static void tlinefill(Line, int, const Glyph *, int, int);
+static int tlineappend(const Glyph *, int, int);
+static void treflow(int, int);
+static void tsetline(int, Line);
 static void tsetattr(const int *, int);
+static Rune tblinkcount(const Glyph *);
 static void tsetchar(Rune, const Glyph *, int, int);
 static void tsetdirt(int, int);
+static void tsetdirtspan(int, int, int);
 static void tsetscroll(int, int);
 static void tswapscreen(void);
 static void tsetmode(int, int, const int *, int);
-static int twrite(const char *, int, int);
-static void tfulldirt(void);
 static void tcontrolcode(uchar );
 static void tdectest(char );
 static void tdefutf8(char);
@@ -209,35 +420,86 @@ static int32_t tdefcolor(const int *, int *, int);
 static void tdeftran(char);
 static void tstrsequence(uchar);
 
+static void tsnapshot(void);
 static void drawregion(int, int, int, int);
 
 static void selnormalize(void);
+static void selrows(void);
+static Span selspan(int);
 static void selscroll(int, int);
 static void selsnap(int *, int *, int);
 
+static Rune searchfold(Rune);
+static void sigbit(Sig *, Rune, Rune);
+static void sigput(Sig *, Rune *, Rune);
+static Sig linesig(const Glyph *, int);
+static Sig packsig(const uchar *);
+static void searchgrow(void);
+static void searchindex(void);
+static void searchreset(void);
+static Line searchline(uint64_t);
+static int searchrow(const Glyph *);
+static Sig searchsig(int);
+static int searchfind(uint64_t, int, int);
+static void searchshow(void);
+static void searchback(void);
+static int searchliteral(const Rune *, int, Rune *);
+static void searchupdate(void);
+static void searchprompt(Line);
+
 static size_t utf8decode(const char *, Rune *, size_t);
+static size_t utf8decodebuf(const char *, size_t, Rune *, size_t, size_t *);
+static size_t utf8ascii(const char *, size_t, Rune *);
+#ifdef X86_SIMD
+static size_t utf8ascii_sse2(const char *, size_t, Rune *);
+static size_t utf8ascii_avx2(const char *, size_t, Rune *);
+#endif
 static Rune utf8decodebyte(char, size_t *);
 static char utf8encodebyte(Rune, size_t);
 static size_t utf8validate(Rune *, size_t);
-
-static char *base64dec(const char *);
-static char base64dec_getc(const char **);
+static int runewidth(Rune);
+
+static void base64put(Base64 *, const char *, size_t);
+static void base64pad(Base64 *);
+static char *base64end(Base64 *);
+static size_t base64dec_none(const char *, size_t, char *);
+#ifdef X86_SIMD
+static size_t base64dec_sse2(const char *, size_t, char *);
+#endif
 
 static ssize_t xwrite(int, const char *, size_t);
 
 /* Globals */
 static Term term;
+static Snapshot snap;
+static pthread_mutex_t termlock, handoff = PTHREAD_MUTEX_INITIALIZER;
 static Selection sel;
+static Search srch;
 static CSIEscape csiescseq;
 static STREscape strescseq;
 static int iofd = 1;
 static int cmdfd;
 static pid_t pid;
 
+/* tty read statistics, see ttystats() */
+static struct {
+	unsigned long wakeups; /* calls to ttyread() */
+	unsigned long reads;   /* read(2) calls that returned data */
+	unsigned long bytes;   /* bytes read */
+} ttystat;
+
+/* bytes written to the tty which it did not take yet, a ring buffer */
+static struct {
+	char *buf;
+	size_t size, start, len;
+} ttyout;
+
 static const uchar utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static const uchar utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
 static const Rune utfmin[UTF_SIZ + 1] = {       0,    0,  0x80,  0x800,  0x10000};
 static const Rune utfmax[UTF_SIZ + 1] = {0x10FFFF, 0x7F, 0x7FF, 0xFFFF, 0x10FFFF};
+static size_t (*utf8asciirun)(const char *, size_t, Rune *);
+static size_t (*base64run)(const char *, size_t, char *);
 
 ssize_t
 xwrite(int fd, const char *s, size_t len)
@@ -312,6 +574,99 @@ utf8decode(const char *c, Rune *u, size_t clen)
 	return len;
 }
 
+/*
+ * Decode as much of c as fits into u and return the number of runes.
+ * The number of bytes consumed is stored in used; an incomplete sequence
+ * at the end of c is left alone, as utf8decode() does. Runs of ASCII
+ * are widened by the fastest routine the cpu supports.
+ */
+size_t
+utf8decodebuf(const char *c, size_t clen, Rune *u, size_t ulen, size_t *used)
+{
+	size_t i = 0, n = 0, len;
+
+	if (!utf8asciirun) {
+		utf8asciirun = utf8ascii;
+#ifdef X86_SIMD
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			utf8asciirun = utf8ascii_avx2;
+		else if (__builtin_cpu_supports("sse2"))
+			utf8asciirun = utf8ascii_sse2;
+#endif
+	}
+
+	while (i < clen && n < ulen) {
+		len = utf8asciirun(c + i, MIN(clen - i, ulen - n), u + n);
+		i += len;
+		n += len;
+		for (; i < clen && n < ulen && (c[i] & 0x80); n++, i += len) {
+			if (!(len = utf8decode(c + i, &u[n], clen - i)))
+				goto end;
+		}
+	}
+end:
+	*used = i;
+	return n;
+}
+
+/* widen the leading ASCII bytes of c into u */
+size_t
+utf8ascii(const char *c, size_t len, Rune *u)
+{
+	size_t i;
+
+	for (i = 0; i < len && !(c[i] & 0x80); i++)
+		u[i] = c[i];
+
+	return i;
+}
+
+#ifdef X86_SIMD
+__attribute__((target("sse2")))
+size_t
+utf8ascii_sse2(const char *c, size_t len, Rune *u)
+{
+	__m128i v, lo, hi, z = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(c + i));
+		if (_mm_movemask_epi8(v))
+			break;
+		lo = _mm_unpacklo_epi8(v, z);
+		hi = _mm_unpackhi_epi8(v, z);
+		_mm_storeu_si128((__m128i *)(u + i), _mm_unpacklo_epi16(lo, z));
+		_mm_storeu_si128((__m128i *)(u + i + 4), _mm_unpackhi_epi16(lo, z));
+		_mm_storeu_si128((__m128i *)(u + i + 8), _mm_unpacklo_epi16(hi, z));
+		_mm_storeu_si128((__m128i *)(u + i + 12), _mm_unpackhi_epi16(hi, z));
+	}
+
+	return i + utf8ascii(c + i, len - i, u + i);
+}
+
+__attribute__((target("avx2")))
+size_t
+utf8ascii_avx2(const char *c, size_t len, Rune *u)
+{
+	__m256i v;
+	size_t i, j;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(c + i));
+		if (_mm256_movemask_epi8(v))
+			break;
+		for (j = 0; j < 32; j += 8) {
+			_mm256_storeu_si256((__m256i *)(u + i + j),
+			    _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+			    (const __m128i *)(c + i + j))));
+		}
+	}
+
+	return i + utf8ascii(c + i, len - i, u + i);
+}
+#endif
+
 Rune
 utf8decodebyte(char c, size_t *i)
 {
@@ -357,50 +712,177 @@ utf8validate(Rune *u, size_t i)
 	return i;
 }
 
-char
-base64dec_getc(const char **src)
+/* wcwidth() of the Unicode version of width.h, whatever the locale */
+int
+runewidth(Rune u)
 {
-	while (**src && !isprint((unsigned char)**src))
-		(*src)++;
-	return **src ? *((*src)++) : '=';  /* emulate padding if string ends */
+	int w;
+
+	if (u > 0x10FFFF)
+		return -1;
+	w = widthblk[widthidx[u >> 8]][(u & 0xFF) >> 2] >> (u & 3) * 2 & 3;
+	return w == 3 ? -1 : w;
 }
 
-char *
-base64dec(const char *src)
-{
-	size_t in_len = strlen(src);
-	char *result, *dst;
-	static const char base64_digits[256] = {
-		[43] = 62, 0, 0, 0, 63, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61,
-		0, 0, 0, -1, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
-		13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 0, 0, 0, 0,
-		0, 0, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39,
-		40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51
-	};
+static const signed char base64_digits[256] = {
+	[43] = 62, 0, 0, 0, 63, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61,
+	0, 0, 0, -1, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
+	13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 0, 0, 0, 0,
+	0, 0, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39,
+	40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51
+};
 
-	if (in_len % 4)
-		in_len += 4 - (in_len % 4);
-	result = dst = xmalloc(in_len / 4 * 3 + 1);
-	while (*src) {
-		int a = base64_digits[(unsigned char) base64dec_getc(&src)];
-		int b = base64_digits[(unsigned char) base64dec_getc(&src)];
-		int c = base64_digits[(unsigned char) base64dec_getc(&src)];
-		int d = base64_digits[(unsigned char) base64dec_getc(&src)];
-
-		/* invalid input. 'a' can be -1, e.g. if src is "\n" (c-str) */
-		if (a == -1 || b == -1)
-			break;
+/* decode nothing, for cpus without the instructions */
+size_t
+base64dec_none(const char *s, size_t n, char *d)
+{
+	return 0;
+}
 
-		*dst++ = (a << 2) | ((b & 0x30) >> 4);
-		if (c == -1)
+#ifdef X86_SIMD
+/*
+ * Decode blocks of 16 base64 digits into 12 bytes each, up to the first
+ * block with anything else in it. Returns the number of digits used.
+ */
+__attribute__((target("sse2")))
+size_t
+base64dec_sse2(const char *s, size_t n, char *d)
+{
+	__m128i v, upper, lower, digit, plus, slash, x;
+	uint32_t w[4];
+	size_t i;
+	int j;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+		                      _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+		lower = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('a' - 1)),
+		                      _mm_cmplt_epi8(v, _mm_set1_epi8('z' + 1)));
+		digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+		                      _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+		plus = _mm_cmpeq_epi8(v, _mm_set1_epi8('+'));
+		slash = _mm_cmpeq_epi8(v, _mm_set1_epi8('/'));
+		x = _mm_or_si128(_mm_or_si128(upper, lower),
+		                 _mm_or_si128(_mm_or_si128(digit, plus), slash));
+		if (_mm_movemask_epi8(x) != 0xFFFF)
 			break;
-		*dst++ = ((b & 0x0f) << 4) | ((c & 0x3c) >> 2);
-		if (d == -1)
+
+		/* the value of each digit */
+		x = _mm_and_si128(upper, _mm_set1_epi8(-'A'));
+		x = _mm_or_si128(x, _mm_and_si128(lower, _mm_set1_epi8(26 - 'a')));
+		x = _mm_or_si128(x, _mm_and_si128(digit, _mm_set1_epi8(52 - '0')));
+		x = _mm_or_si128(x, _mm_and_si128(plus, _mm_set1_epi8(62 - '+')));
+		x = _mm_or_si128(x, _mm_and_si128(slash, _mm_set1_epi8(63 - '/')));
+		v = _mm_add_epi8(v, x);
+
+		/* pairs of digits into 12 bits, then groups into 24 */
+		v = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v,
+		                 _mm_set1_epi16(0xFF)), 6), _mm_srli_epi16(v, 8));
+		v = _mm_madd_epi16(v, _mm_set1_epi32(1 << 16 | 1 << 12));
+		_mm_storeu_si128((__m128i *)w, v);
+		for (j = 0; j < 4; j++) {
+			*d++ = w[j] >> 16;
+			*d++ = w[j] >> 8;
+			*d++ = w[j];
+		}
+	}
+
+	return i;
+}
+#endif
+
+/*
+ * Decode the next n characters of base64. As before the whole text was
+ * kept, characters which are not printable are skipped, other invalid
+ * ones count as 'A' and the first '=' ends the text.
+ */
+void
+base64put(Base64 *b, const char *s, size_t n)
+{
+	size_t i = 0, m;
+	int c, v;
+
+	if (!base64run) {
+		base64run = base64dec_none;
+#ifdef X86_SIMD
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse2"))
+			base64run = base64dec_sse2;
+#endif
+	}
+
+	if (b->state != B64_ON)
+		return;
+	if (b->len + n / 4 * 3 + 3 > b->siz) {
+		b->siz = MAX(2 * b->siz, b->len + n / 4 * 3 + 3);
+		b->buf = xrealloc(b->buf, b->siz);
+	}
+
+	while (i < n) {
+		if (b->n == 0) {
+			m = base64run(s + i, n - i, b->buf + b->len);
+			b->len += m / 4 * 3;
+			if ((i += m) == n)
+				break;
+		}
+		c = (uchar)s[i++];
+		if (!isprint(c))
+			continue;
+		if ((v = base64_digits[c]) == -1) {
+			base64pad(b);
 			break;
-		*dst++ = ((c & 0x03) << 6) | d;
+		}
+		b->bits = b->bits << 6 | v;
+		if (++b->n == 4) {
+			b->buf[b->len++] = b->bits >> 16;
+			b->buf[b->len++] = b->bits >> 8;
+			b->buf[b->len++] = b->bits;
+			b->n = 0;
+		}
+	}
+
+	if (b->len > osc52max) {
+		free(b->buf);
+		b->buf = NULL;
+		b->state = B64_TOOLONG;
+	}
+}
+
+/* Decode what is left of an incomplete group, and nothing after it. */
+void
+base64pad(Base64 *b)
+{
+	if (b->state != B64_ON)
+		return;
+	if (b->len + 3 > b->siz) {
+		b->siz = b->len + 3;
+		b->buf = xrealloc(b->buf, b->siz);
 	}
-	*dst = '\0';
-	return result;
+	/* a lone digit has too few bits for a byte */
+	if (b->n >= 2)
+		b->buf[b->len++] = b->bits >> (b->n == 2 ? 4 : 10);
+	if (b->n == 3)
+		b->buf[b->len++] = b->bits >> 2;
+	b->n = 0;
+	b->state = B64_END;
+}
+
+/* Return the decoded text, or NULL if it was too long. */
+char *
+base64end(Base64 *b)
+{
+	char *text;
+
+	if (b->state == B64_TOOLONG)
+		return NULL;
+	base64pad(b);
+	if (b->len + 1 > b->siz)
+		b->buf = xrealloc(b->buf, b->len + 1);
+	b->buf[b->len] = '\0';
+	text = b->buf;
+	*b = (Base64){ .state = B64_END };
+	return text;
 }
 
 void
@@ -464,6 +946,7 @@ selextend(int col, int row, int type, int done)
 	sel.oe.y = row;
 	selnormalize();
 	sel.type = type;
+	selrows();
 
 	if (oldey != sel.oe.y || oldex != sel.oe.x || oldtype != sel.type || sel.mode == SEL_EMPTY)
 		tsetdirt(MIN(sel.nb.y, oldsby), MAX(sel.ne.y, oldsey));
@@ -490,29 +973,51 @@ selnormalize(void)
 	selsnap(&sel.ne.x, &sel.ne.y, +1);
 
 	/* expand selection over line breaks */
-	if (sel.type == SEL_RECTANGULAR)
-		return;
-	i = tlinelen(sel.nb.y);
-	if (i < sel.nb.x)
-		sel.nb.x = i;
-	if (tlinelen(sel.ne.y) <= sel.ne.x)
-		sel.ne.x = term.col - 1;
+	if (sel.type != SEL_RECTANGULAR) {
+		i = tlinelen(sel.nb.y);
+		if (i < sel.nb.x)
+			sel.nb.x = i;
+		if (tlinelen(sel.ne.y) <= sel.ne.x)
+			sel.ne.x = term.col - 1;
+	}
+	selrows();
 }
 
-int
-selected(int x, int y)
+/* turn the normalized selection into the columns selected in each row */
+void
+selrows(void)
+{
+	int y;
+
+	for (y = 0; y < term.row; y++) {
+		if (!BETWEEN(y, sel.nb.y, sel.ne.y))
+			sel.rows[y] = (Span){ 0, 0 };
+		else if (sel.type == SEL_RECTANGULAR)
+			sel.rows[y] = (Span){ sel.nb.x, sel.ne.x + 1 };
+		else
+			sel.rows[y] = (Span){
+				y == sel.nb.y ? sel.nb.x : 0,
+				y == sel.ne.y ? sel.ne.x + 1 : term.col
+			};
+	}
+}
+
+/* the columns of row y which are shown selected */
+Span
+selspan(int y)
 {
 	if (sel.mode == SEL_EMPTY || sel.ob.x == -1 ||
-			sel.alt != IS_SET(MODE_ALTSCREEN))
-		return 0;
+	    sel.alt != IS_SET(MODE_ALTSCREEN) || !BETWEEN(y, 0, term.row-1))
+		return (Span){ 0, 0 };
+	return sel.rows[y];
+}
 
-	if (sel.type == SEL_RECTANGULAR)
-		return BETWEEN(y, sel.nb.y, sel.ne.y)
-		    && BETWEEN(x, sel.nb.x, sel.ne.x);
+int
+selected(int x, int y)
+{
+	Span s = selspan(y);
 
-	return BETWEEN(y, sel.nb.y, sel.ne.y)
-	    && (y != sel.nb.y || x >= sel.nb.x)
-	    && (y != sel.ne.y || x <= sel.ne.x);
+	return s.x1 <= x && x < s.x2;
 }
 
 void
@@ -588,34 +1093,44 @@ selsnap(int *x, int *y, int direction)
 	}
 }
 
-char *
-getsel(void)
+/*
+ * Put the text of the selection from row *y on into a buffer, as many
+ * rows as fit in SELCHUNK bytes but at least one, and move *y past them.
+ * The buffer is reused by the next call. Returns NULL at the end.
+ */
+const char *
+selread(int *y, size_t *n)
 {
-	char *str, *ptr;
-	int y, bufsize, lastx, linelen;
+	static char *buf;
+	static size_t bufsize;
+	char *ptr;
+	int lastx, linelen;
 	const Glyph *gp, *last;
 
-	if (sel.ob.x == -1)
+	if (sel.ob.x == -1 || *y < sel.nb.y || *y > sel.ne.y)
 		return NULL;
 
-	bufsize = (term.col+1) * (sel.ne.y-sel.nb.y+1) * UTF_SIZ;
-	ptr = str = xmalloc(bufsize);
+	if (bufsize < SELCHUNK + (term.col+1) * UTF_SIZ) {
+		bufsize = SELCHUNK + (term.col+1) * UTF_SIZ;
+		buf = xrealloc(buf, bufsize);
+	}
+	ptr = buf;
 
 	/* append every set & selected glyph to the selection */
-	for (y = sel.nb.y; y <= sel.ne.y; y++) {
-		if ((linelen = tlinelen(y)) == 0) {
+	for (; *y <= sel.ne.y && ptr - buf < SELCHUNK; (*y)++) {
+		if ((linelen = tlinelen(*y)) == 0) {
 			*ptr++ = '\n';
 			continue;
 		}
 
 		if (sel.type == SEL_RECTANGULAR) {
-			gp = &TLINE(y)[sel.nb.x];
+			gp = &TLINE(*y)[sel.nb.x];
 			lastx = sel.ne.x;
 		} else {
-			gp = &TLINE(y)[sel.nb.y == y ? sel.nb.x : 0];
-			lastx = (sel.ne.y == y) ? sel.ne.x : term.col-1;
+			gp = &TLINE(*y)[sel.nb.y == *y ? sel.nb.x : 0];
+			lastx = (sel.ne.y == *y) ? sel.ne.x : term.col-1;
 		}
-		last = &TLINE(y)[MIN(lastx, linelen-1)];
+		last = &TLINE(*y)[MIN(lastx, linelen-1)];
 		while (last >= gp && last->u == ' ')
 			--last;
 
@@ -635,11 +1150,40 @@ getsel(void)
 		 * st.
 		 * FIXME: Fix the computer world.
 		 */
-		if ((y < sel.ne.y || lastx >= linelen) &&
+		if ((*y < sel.ne.y || lastx >= linelen) &&
 		    (!(last->mode & ATTR_WRAP) || sel.type == SEL_RECTANGULAR))
 			*ptr++ = '\n';
 	}
-	*ptr = 0;
+	*n = ptr - buf;
+	return buf;
+}
+
+/*
+ * The text of the selection, in one string. It is taken whole, when the
+ * selection is made, as it is pasted long after its rows scrolled away,
+ * were written over or left the history. Only printsel streams it.
+ */
+char *
+getsel(void)
+{
+	char *str = NULL;
+	const char *p;
+	size_t len = 0, size = 0, n;
+	int y = sel.nb.y;
+
+	if (sel.ob.x == -1)
+		return NULL;
+
+	while ((p = selread(&y, &n))) {
+		if (len + n + 1 > size) {
+			size = MAX(2 * size, len + n + 1);
+			str = xrealloc(str, size);
+		}
+		memcpy(str + len, p, n);
+		len += n;
+	}
+	str = xrealloc(str, len + 1);
+	str[len] = 0;
 	return str;
 }
 
@@ -704,6 +1248,7 @@ execsh(char *cmd, char **args)
 	setenv("SHELL", sh, 1);
 	setenv("HOME", pw->pw_dir, 1);
 	setenv("TERM", termname, 1);
+	setenv("ST_UNICODE_VERSION", UNICODE_VERSION, 1);
 
 	signal(SIGCHLD, SIG_DFL);
 	signal(SIGHUP, SIG_DFL);
@@ -780,6 +1325,7 @@ ttynew(const char *line, char *cmd, const char *out, char **args)
 			    line, strerror(errno));
 		dup2(cmdfd, 0);
 		stty(args);
+		fcntl(cmdfd, F_SETFL, fcntl(cmdfd, F_GETFL) | O_NONBLOCK);
 		return cmdfd;
 	}
 
@@ -815,36 +1361,82 @@ ttynew(const char *line, char *cmd, const char *out, char **args)
 #endif
 		close(s);
 		cmdfd = m;
+		fcntl(cmdfd, F_SETFL, fcntl(cmdfd, F_GETFL) | O_NONBLOCK);
 		signal(SIGCHLD, sigchld);
 		break;
 	}
 	return cmdfd;
 }
 
+/*
+ * Read what the child has written. The tty is drained with non-blocking
+ * reads into a buffer that grows up to ttyreadmax bytes, or until
+ * ttyreadtime ms have passed, and only then parsed, so a flood of output
+ * costs few wakeups and parser calls.
+ */
 size_t
 ttyread(void)
 {
-	static char buf[BUFSIZ];
-	static int buflen = 0;
-	int ret, written;
-
-	/* append read bytes to unprocessed bytes */
-	ret = read(cmdfd, buf+buflen, LEN(buf)-buflen);
+	static char *buf;
+	static size_t bufsiz, buflen;
+	struct timespec start, now;
+	size_t total = 0;
+	ssize_t ret;
+	int written, eof = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ttystat.wakeups++;
+
+	for (;;) {
+		if (buflen == bufsiz) {
+			if (bufsiz >= MAX(ttyreadmax, BUFSIZ))
+				break;
+			bufsiz = bufsiz ? 2 * bufsiz : BUFSIZ;
+			buf = xrealloc(buf, bufsiz);
+		}
 
-	switch (ret) {
-	case 0:
-		exit(0);
-	case -1:
-		die("couldn't read from shell: %s\n", strerror(errno));
-	default:
+		/* append read bytes to unprocessed bytes */
+		ret = read(cmdfd, buf+buflen, bufsiz-buflen);
+		if (ret == 0) {
+			eof = 1;
+			break;
+		} else if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			die("couldn't read from shell: %s\n", strerror(errno));
+		}
 		buflen += ret;
+		total += ret;
+		ttystat.reads++;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (TIMEDIFF(now, start) >= ttyreadtime)
+			break;
+	}
+	ttystat.bytes += total;
+
+	if (total > 0) {
 		written = twrite(buf, buflen, 0);
 		buflen -= written;
 		/* keep any incomplete UTF-8 byte sequence for the next call */
 		if (buflen > 0)
 			memmove(buf, buf + written, buflen);
-		return ret;
 	}
+	if (eof)
+		exit(0);
+
+	return total;
+}
+
+/* Write the tty read statistics to fp. */
+void
+ttystats(FILE *fp)
+{
+	fprintf(fp, "tty: %lu bytes, %lu reads, %lu wakeups, "
+	        "%lu bytes/wakeup\n", ttystat.bytes, ttystat.reads,
+	        ttystat.wakeups, ttystat.bytes / MAX(ttystat.wakeups, 1));
 }
 
 void
@@ -878,61 +1470,92 @@ ttywrite(const char *s, size_t n, int may_echo)
 	}
 }
 
+/*
+ * Queue the bytes for the tty. What it does not take right away is
+ * written by ttyflush() once it is writable, so a large paste never
+ * blocks st.
+ */
 void
 ttywriteraw(const char *s, size_t n)
 {
-	fd_set wfd, rfd;
-	ssize_t r;
-	size_t lim = 256;
+	size_t r, i, size;
+	char *buf;
 
-	/*
-	 * Remember that we are using a pty, which might be a modem line.
-	 * Writing too much will clog the line. That's why we are doing this
-	 * dance.
-	 * FIXME: Migrate the world to Plan 9.
-	 */
-	while (n > 0) {
-		FD_ZERO(&wfd);
-		FD_ZERO(&rfd);
-		FD_SET(cmdfd, &wfd);
-		FD_SET(cmdfd, &rfd);
+	/* keep the order of the bytes queued before */
+	if (ttyout.len == 0) {
+		r = ttywritenb(s, n);
+		s += r;
+		n -= r;
+	}
+	if (n == 0)
+		return;
+
+	if (ttyout.len + n > ttyout.size) {
+		size = MAX(MAX(2 * ttyout.size, ttyout.len + n), BUFSIZ);
+		buf = xmalloc(size);
+		i = MIN(ttyout.len, ttyout.size - ttyout.start);
+		if (ttyout.len > 0) {
+			memcpy(buf, ttyout.buf + ttyout.start, i);
+			memcpy(buf + i, ttyout.buf, ttyout.len - i);
+		}
+		free(ttyout.buf);
+		ttyout.buf = buf;
+		ttyout.size = size;
+		ttyout.start = 0;
+	}
+	i = (ttyout.start + ttyout.len) % ttyout.size;
+	r = MIN(n, ttyout.size - i);
+	memcpy(ttyout.buf + i, s, r);
+	memcpy(ttyout.buf, s + r, n - r);
+	ttyout.len += n;
+}
 
-		/* Check if we can write. */
-		if (pselect(cmdfd+1, &rfd, &wfd, NULL, NULL, NULL) < 0) {
+/* Write as much as the tty takes without blocking. */
+size_t
+ttywritenb(const char *s, size_t n)
+{
+	size_t total = 0;
+	ssize_t r;
+
+	while (total < n) {
+		if ((r = write(cmdfd, s + total, n - total)) < 0) {
 			if (errno == EINTR)
 				continue;
-			die("select failed: %s\n", strerror(errno));
-		}
-		if (FD_ISSET(cmdfd, &wfd)) {
-			/*
-			 * Only write the bytes written by ttywrite() or the
-			 * default of 256. This seems to be a reasonable value
-			 * for a serial line. Bigger values might clog the I/O.
-			 */
-			if ((r = write(cmdfd, s, (n < lim)? n : lim)) < 0)
-				goto write_error;
-			if (r < n) {
-				/*
-				 * We weren't able to write out everything.
-				 * This means the buffer is getting full
-				 * again. Empty it.
-				 */
-				if (n < lim)
-					lim = ttyread();
-				n -= r;
-				s += r;
-			} else {
-				/* All bytes have been written. */
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
 				break;
-			}
+			die("write error on tty: %s\n", strerror(errno));
 		}
-		if (FD_ISSET(cmdfd, &rfd))
-			lim = ttyread();
+		total += r;
 	}
-	return;
+	return total;
+}
+
+/*
+ * Write the queued bytes the tty takes now. Returns the number of bytes
+ * left, which wait for the tty to be writable again.
+ */
+size_t
+ttyflush(void)
+{
+	size_t n, r;
 
-write_error:
-	die("write error on tty: %s\n", strerror(errno));
+	while (ttyout.len > 0) {
+		n = MIN(ttyout.len, ttyout.size - ttyout.start);
+		if ((r = ttywritenb(ttyout.buf + ttyout.start, n)) == 0)
+			break;
+		ttyout.start = (ttyout.start + r) % ttyout.size;
+		ttyout.len -= r;
+	}
+	if (ttyout.len == 0) {
+		ttyout.start = 0;
+		/* give back what a large paste took */
+		if (ttyout.size > BUFSIZ) {
+			free(ttyout.buf);
+			ttyout.buf = NULL;
+			ttyout.size = 0;
+		}
+	}
+	return ttyout.len;
 }
 
 void
@@ -956,20 +1579,31 @@ ttyhangup(void)
 }
 
 int
-tattrset(int attr)
+tblinking(void)
 {
-	int i, j;
+	int i;
 
-	for (i = 0; i < term.row-1; i++) {
-		for (j = 0; j < term.col-1; j++) {
-			if (term.line[i][j].mode & attr)
-				return 1;
-		}
+	for (i = 0; i < term.row; i++) {
+		if (TBLINKS(term.line[i]))
+			return 1;
 	}
 
 	return 0;
 }
 
+/* The blinking cells of l, counted again. */
+Rune
+tblinkcount(const Glyph *l)
+{
+	Rune n = 0;
+	int i;
+
+	for (i = 0; i < term.col; i++)
+		n += (l[i].mode & ATTR_BLINK) != 0;
+
+	return n;
+}
+
 void
 tsetdirt(int top, int bot)
 {
@@ -979,20 +1613,39 @@ tsetdirt(int top, int bot)
 	LIMIT(bot, 0, term.row-1);
 
 	for (i = top; i <= bot; i++)
-		term.dirty[i] = 1;
+		term.dirty[i] = (Span){ 0, term.col };
 }
 
+/* Add columns x1 up to x2 of line y to what needs drawing. */
 void
-tsetdirtattr(int attr)
+tsetdirtspan(int y, int x1, int x2)
+{
+	Span *d = &term.dirty[y];
+
+	LIMIT(x1, 0, term.col);
+	LIMIT(x2, 0, term.col);
+	if (x1 >= x2)
+		return;
+	if (d->x1 >= d->x2) {
+		d->x1 = x1;
+		d->x2 = x2;
+	} else {
+		d->x1 = MIN(d->x1, x1);
+		d->x2 = MAX(d->x2, x2);
+	}
+}
+
+void
+tsetdirtblink(void)
 {
 	int i, j;
 
-	for (i = 0; i < term.row-1; i++) {
-		for (j = 0; j < term.col-1; j++) {
-			if (term.line[i][j].mode & attr) {
-				tsetdirt(i, i);
-				break;
-			}
+	for (i = 0; i < term.row; i++) {
+		if (!TBLINKS(term.line[i]))
+			continue;
+		for (j = 0; j < term.col; j++) {
+			if (term.line[i][j].mode & ATTR_BLINK)
+				tsetdirtspan(i, j, j+1);
 		}
 	}
 }
@@ -1006,26 +1659,147 @@ tfulldirt(void)
 void
 tcursor(int mode)
 {
-	static TCursor c[2];
 	int alt = IS_SET(MODE_ALTSCREEN);
 
 	if (mode == CURSOR_SAVE) {
-		c[alt] = term.c;
+		term.sc[alt] = term.c;
 	} else if (mode == CURSOR_LOAD) {
-		term.c = c[alt];
-		tmoveto(c[alt].x, c[alt].y);
+		term.c = term.sc[alt];
+		tmoveto(term.sc[alt].x, term.sc[alt].y);
 	}
 }
 
-void
-treset(void)
+uint
+penhashidx(uint32_t fg, uint32_t bg)
 {
-	uint i;
+	uint h = fg * 0x9E3779B1u ^ bg * 0x85EBCA77u;
 
-	term.c = (TCursor){{
-		.mode = ATTR_NULL,
-		.fg = defaultfg,
-		.bg = defaultbg
+	return (h ^ h >> 15) & (2 * term.pencap - 1);
+}
+
+void
+penrehash(void)
+{
+	uint h;
+	int i;
+
+	memset(term.penhash, 0, 2 * term.pencap * sizeof(*term.penhash));
+	for (i = 1; i < term.npens; i++) {
+		if (term.pens[i].fg == PEN_FREE)
+			continue;
+		h = penhashidx(term.pens[i].fg, term.pens[i].bg);
+		while (term.penhash[h])
+			h = (h + 1) & (2 * term.pencap - 1);
+		term.penhash[h] = i;
+	}
+}
+
+/*
+ * Free the pens no cell, cursor or saved cursor refers to any more.
+ * Pens are never renumbered, so cells don't have to be rewritten.
+ */
+int
+pengc(void)
+{
+	uchar *used = xmalloc(term.npens);
+	int i, x, freed = 0;
+
+	memset(used, 0, term.npens);
+	for (i = 0; i < term.hot + term.row; i++) {
+		for (x = 0; term.ring[i] && x < term.col; x++)
+			used[term.ring[i][x].pen] = 1;
+	}
+	for (i = 0; i < term.row; i++) {
+		for (x = 0; x < term.col; x++)
+			used[term.alt[i][x].pen] = 1;
+	}
+	for (i = 0; i < term.row + 1; i++) {
+		for (x = 0; x < term.col; x++)
+			used[term.cache[i][x].pen] = 1;
+	}
+	for (i = 0; i < term.lbufcap; i++)
+		used[term.lbuf[i].pen] = 1;
+	used[term.c.attr.pen] = 1;
+	used[term.sc[0].attr.pen] = 1;
+	used[term.sc[1].attr.pen] = 1;
+
+	for (i = term.npens - 1; i > 0; i--) {
+		if (used[i] || term.pens[i].fg == PEN_FREE)
+			continue;
+		term.pens[i] = (Pen){ .fg = PEN_FREE, .bg = term.penfree };
+		term.penfree = i;
+		freed++;
+	}
+	free(used);
+	penrehash();
+
+	return freed;
+}
+
+/*
+ * Return the pen holding the color pair fg, bg, allocating one if needed.
+ * Cells store pens instead of colors to stay small.
+ */
+ushort
+tinternpen(uint32_t fg, uint32_t bg)
+{
+	uint h;
+	ushort p;
+
+	if (fg == term.pens[0].fg && bg == term.pens[0].bg)
+		return 0;
+	for (h = penhashidx(fg, bg); (p = term.penhash[h]);
+	     h = (h + 1) & (2 * term.pencap - 1)) {
+		if (term.pens[p].fg == fg && term.pens[p].bg == bg)
+			return p;
+	}
+
+	if (!term.penfree && term.npens == term.pencap) {
+		if (term.pencap < PEN_MAX) {
+			term.pencap *= 2;
+			term.pens = xrealloc(term.pens,
+			                     term.pencap * sizeof(*term.pens));
+			term.penhash = xrealloc(term.penhash,
+			        2 * term.pencap * sizeof(*term.penhash));
+			penrehash();
+		} else if (!pengc()) {
+			/* every pen is on screen, fall back to the default */
+			return 0;
+		}
+		for (h = penhashidx(fg, bg); term.penhash[h];
+		     h = (h + 1) & (2 * term.pencap - 1))
+			;
+	}
+
+	if (term.penfree) {
+		p = term.penfree;
+		term.penfree = term.pens[p].bg;
+	} else {
+		p = term.npens++;
+	}
+	term.pens[p] = (Pen){ .fg = fg, .bg = bg };
+	term.penhash[h] = p;
+	term.pendirty.x1 = MIN(term.pendirty.x1, p);
+	term.pendirty.x2 = MAX(term.pendirty.x2, p + 1);
+
+	return p;
+}
+
+/* the pens of the cells drawn, see tsnapshot() */
+Pen
+tpen(ushort p)
+{
+	return snap.pens[p];
+}
+
+void
+treset(void)
+{
+	uint i;
+
+	term.c = (TCursor){{
+		.mode = ATTR_NULL,
+		.pen = 0
 	}, .x = 0, .y = 0, .state = CURSOR_DEFAULT};
 
 	memset(term.tabs, 0, term.col * sizeof(*term.tabs));
@@ -1048,7 +1822,20 @@ treset(void)
 void
 tnew(int col, int row)
 {
-	term = (Term){ .c = { .attr = { .fg = defaultfg, .bg = defaultbg } } };
+	pthread_mutexattr_t attr;
+
+	term = (Term){ .npens = 1, .pencap = 256,
+	               .hot = MIN(histsize, HISTHOT) };
+	term.pens = xmalloc(term.pencap * sizeof(*term.pens));
+	term.penhash = xmalloc(2 * term.pencap * sizeof(*term.penhash));
+	term.pens[0] = (Pen){ .fg = defaultfg, .bg = defaultbg };
+	term.pendirty = (Span){ 0, 1 };
+	penrehash();
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&termlock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	srch.pushed = srch.lo = srch.hi = (uint64_t)1 << 62;
 	tresize(col, row);
 	treset();
 }
@@ -1056,11 +1843,8 @@ tnew(int col, int row)
 void
 tswapscreen(void)
 {
-	Line *tmp = term.line;
-
-	term.line = term.alt;
-	term.alt = tmp;
 	term.mode ^= MODE_ALTSCREEN;
+	term.line = IS_SET(MODE_ALTSCREEN) ? term.alt : &term.ring[term.base];
 	tfulldirt();
 }
 
@@ -1083,46 +1867,1032 @@ kscrolldown(const Arg* a)
 }
 
 void
-kscrollup(const Arg* a)
+kscrollup(const Arg* a)
+{
+	int n = a->i;
+
+	if (n < 0)
+		n = term.row + n;
+
+	while (term.scr + n > term.histn && thistreflow())
+		;
+	n = MIN(n, term.histn - term.scr);
+	if (n > 0) {
+		term.scr += n;
+		selscroll(0, n);
+		tfulldirt();
+	}
+}
+
+/* Fold the case of u for matching and the signatures. */
+Rune
+searchfold(Rune u)
+{
+	if (u < 0x80)
+		return BETWEEN(u, 'A', 'Z') ? u + 32 : u;
+	return towlower(u);
+}
+
+/* Set the bit of the pair of case folded runes p c in s. */
+void
+sigbit(Sig *s, Rune p, Rune c)
+{
+	uint32_t h = ((p << 7) ^ c) * 0x9E3779B1u >> 25;
+	uint64_t bit = (uint64_t)1 << (h & 63), m = -(uint64_t)(h >> 6);
+
+	s->w[0] |= bit & ~m;
+	s->w[1] |= bit & m;
+}
+
+/*
+ * Add the pair of the rune *p and c, folded and blanks being 0, to s and
+ * make c the last rune. There are no branches on the runes of plain
+ * text, a search may have to take the signatures of the whole history.
+ */
+void
+sigput(Sig *s, Rune *p, Rune c)
+{
+	if (c >= 0x80)
+		c = searchfold(c);
+	c += (c - 'A' < 26u) << 5;
+	c &= -(Rune)(c != ' ');
+	sigbit(s, *p, c);
+	*p = c;
+}
+
+/*
+ * The signature of a row has a bit set for each pair of adjacent runes
+ * in it. A row can only match if it has all the bits of the query.
+ */
+Sig
+linesig(const Glyph *l, int col)
+{
+	Sig s = { { 0, 0 } };
+	Rune p = 0;
+	int x;
+
+	while (col > 0 && l[col-1].u == ' ')
+		col--;
+	for (x = 0; x < col; x++) {
+		if (!(l[x].mode & ATTR_WDUMMY))
+			sigput(&s, &p, l[x].u);
+	}
+	return s;
+}
+
+/* The signature of the packed line p, read without unpacking it. */
+Sig
+packsig(const uchar *p)
+{
+	Sig s = { { 0, 0 } };
+	Rune u, prev = 0;
+	int i, n, mode;
+
+	linevarint(&p);
+	while ((n = p[0] | p[1] << 8)) {
+		p += 2;
+		mode = linevarint(&p);
+		linevarint(&p);
+		linevarint(&p);
+		for (i = 0; i < n; i++) {
+			if (*p < 0x80)
+				u = *p++;
+			else
+				p += utf8decode((const char *)p, &u, UTF_SIZ);
+			if (!(mode & ATTR_WDUMMY))
+				sigput(&s, &prev, u);
+		}
+	}
+	return s;
+}
+
+/* Make room in the index for one more row. */
+void
+searchgrow(void)
+{
+	Sig *sig;
+	uint64_t n;
+	size_t cap = MAX(2 * srch.cap, 256);
+
+	sig = xmalloc(cap * sizeof(*sig));
+	for (n = srch.lo; n < srch.hi; n++)
+		sig[n % cap] = srch.sig[n % srch.cap];
+	free(srch.sig);
+	srch.sig = sig;
+	srch.cap = cap;
+}
+
+/* Return the signature of the history row k. */
+Sig
+searchsig(int k)
+{
+	if (k > term.hot && k <= term.histn - term.rfn)
+		return packsig(term.cold[(term.coldseq - k) % term.coldcap]);
+	return linesig(thistline(k), term.col);
+}
+
+/* Index the rows pushed since the last search. */
+void
+searchindex(void)
+{
+	uint64_t bot = srch.pushed - term.histn;
+
+	/* the rows dropped from the history leave the index */
+	if (srch.hi < bot)
+		srch.lo = srch.hi = bot;
+	else if (srch.lo < bot)
+		srch.lo = bot;
+	for (; srch.hi < srch.pushed; srch.hi++) {
+		if (srch.hi - srch.lo == srch.cap)
+			searchgrow();
+		srch.sig[srch.hi % srch.cap] = searchsig(srch.pushed - srch.hi);
+	}
+}
+
+/* Forget the index and the match, the rows were laid out again. */
+void
+searchreset(void)
+{
+	srch.found = 0;
+	srch.origin = srch.pushed + term.row - 1 - term.scr;
+	srch.lo = srch.hi = MIN(srch.origin + 1, srch.pushed);
+}
+
+/*
+ * Return row n, NULL if there is no such row. The screen rows are
+ * numbered from srch.pushed on, the history rows down from it.
+ */
+Line
+searchline(uint64_t n)
+{
+	uint64_t k;
+
+	if (n >= srch.pushed)
+		return n - srch.pushed < term.row ? term.line[n - srch.pushed] : NULL;
+	if ((k = srch.pushed - n) > INT_MAX)
+		return NULL;
+	while (k > term.histn && thistreflow())
+		;
+	return k <= term.histn ? thistline(k) : NULL;
+}
+
+/* Find the matches of the query in l and return their number. */
+int
+searchrow(const Glyph *l)
+{
+	regmatch_t pm;
+	Rune c;
+	int i, j, n, b, nm = 0, off, so, eo;
+
+	if (srch.textcap < term.col) {
+		srch.textcap = term.col;
+		srch.text = xrealloc(srch.text, (term.col + 1) * sizeof(Rune));
+		srch.cols = xrealloc(srch.cols, (term.col + 1) * sizeof(int));
+		srch.utf = xrealloc(srch.utf, term.col * UTF_SIZ + 1);
+		srch.runeof = xrealloc(srch.runeof,
+		                       (term.col * UTF_SIZ + 1) * sizeof(int));
+		srch.m = xrealloc(srch.m, term.col * sizeof(Span));
+	}
+	if (srch.qlen == 0 || srch.status == SEARCH_BADREGEX)
+		return 0;
+
+	for (i = 0, n = 0; i < term.col; i++) {
+		if (l[i].mode & ATTR_WDUMMY)
+			continue;
+		srch.text[n] = l[i].u ? l[i].u : ' ';
+		srch.cols[n++] = i;
+	}
+	srch.cols[n] = term.col;
+
+	if (!srch.regex) {
+		for (i = 0; i + srch.qlen <= n; ) {
+			for (j = 0; j < srch.qlen; j++) {
+				c = srch.text[i + j];
+				if ((srch.icase ? searchfold(c) : c) != srch.q[j])
+					break;
+			}
+			if (j < srch.qlen) {
+				i++;
+				continue;
+			}
+			srch.m[nm++] = (Span){ srch.cols[i], srch.cols[i + j] };
+			i += j;
+		}
+		return nm;
+	}
+
+	for (i = 0, b = 0; i < n; i++) {
+		j = utf8encode(srch.text[i], srch.utf + b);
+		while (j-- > 0)
+			srch.runeof[b++] = i;
+	}
+	srch.runeof[b] = n;
+	srch.utf[b] = '\0';
+	for (off = 0; off <= b && nm < term.col; ) {
+		if (regexec(&srch.re, srch.utf + off, 1, &pm,
+		            off ? REG_NOTBOL : 0))
+			break;
+		so = off + pm.rm_so;
+		eo = off + pm.rm_eo;
+		if (eo > so) {
+			srch.m[nm++] = (Span){ srch.cols[srch.runeof[so]],
+			                       srch.cols[srch.runeof[eo]] };
+			off = eo;
+		} else {
+			/* step over the rune after an empty match */
+			for (off = eo + 1; off < b &&
+			     srch.runeof[off] == srch.runeof[off-1]; off++)
+				;
+		}
+	}
+	return nm;
+}
+
+/*
+ * Find the match nearest to column x of row n, looking in the rows
+ * before it if dir is 1 and after it if dir is -1. The rows of the
+ * history are first checked against the index.
+ */
+int
+searchfind(uint64_t n, int x, int dir)
+{
+	const Sig *q = &srch.qsig;
+	uint64_t k;
+	Line l;
+	Sig s;
+	int i, nm;
+
+	for (;; n -= dir, x = dir > 0 ? INT_MAX : -1) {
+		/* the last row of the screen is under the query in any view */
+		if (n == srch.pushed + term.row - 1)
+			continue;
+		if (n >= srch.lo && n < srch.hi) {
+			s = srch.sig[n % srch.cap];
+		} else if (n < srch.pushed) {
+			if ((k = srch.pushed - n) > INT_MAX)
+				return 0;
+			while (k > term.histn && thistreflow())
+				;
+			if (k > term.histn)
+				return 0;
+			s = searchsig(k);
+			if (n + 1 == srch.lo) {
+				if (srch.hi - srch.lo == srch.cap)
+					searchgrow();
+				srch.sig[n % srch.cap] = s;
+				srch.lo--;
+			}
+		}
+		if (n < srch.pushed && ((s.w[0] & q->w[0]) != q->w[0] ||
+		    (s.w[1] & q->w[1]) != q->w[1]))
+			continue;
+		if (!(l = searchline(n)))
+			return 0;
+
+		nm = searchrow(l);
+		if (dir > 0) {
+			for (i = nm-1; i >= 0 && srch.m[i].x1 >= x; i--)
+				;
+		} else {
+			for (i = 0; i < nm && srch.m[i].x1 <= x; i++)
+				;
+		}
+		if (i >= 0 && i < nm) {
+			srch.at = n;
+			srch.x1 = srch.m[i].x1;
+			srch.x2 = srch.m[i].x2;
+			srch.found = 1;
+			return 1;
+		}
+	}
+}
+
+/* Scroll to the match and select it. */
+void
+searchshow(void)
+{
+	Arg arg;
+	uint64_t top = srch.pushed - term.scr;
+	int y;
+
+	/* the last row is under the query */
+	if (srch.at < top || srch.at >= top + term.row - 1) {
+		/* put it in the middle of the view */
+		arg.i = (int64_t)(srch.pushed - srch.at) + term.row/2 - term.scr;
+		if (arg.i > 0) {
+			kscrollup(&arg);
+		} else if (arg.i < 0) {
+			arg.i = -arg.i;
+			kscrolldown(&arg);
+		}
+		top = srch.pushed - term.scr;
+	}
+	y = srch.at - top;
+	selstart(srch.x1, y, 0);
+	selextend(srch.x2 - 1, y, SEL_REGULAR, 0);
+	sel.mode = SEL_IDLE;
+}
+
+/* Put the view back where the search started. */
+void
+searchback(void)
+{
+	Arg arg = { .i = 0 };
+
+	selclear();
+	if (srch.scr > 0)
+		arg.i = srch.pushed + term.row - 1 - srch.origin;
+	arg.i -= term.scr;
+	if (arg.i > 0) {
+		kscrollup(&arg);
+	} else if (arg.i < 0) {
+		arg.i = -arg.i;
+		kscrolldown(&arg);
+	}
+}
+
+/*
+ * Return the longest run of runes which any match of the regular
+ * expression q contains, found the simple way: none if there is an
+ * alternative, and nothing inside of groups.
+ */
+int
+searchliteral(const Rune *q, int n, Rune *lit)
+{
+	Rune run[SEARCH_SIZ], c;
+	int i, len = 0, best = 0, depth = 0;
+
+	for (i = 0; i <= n; i++) {
+		c = i < n ? q[i] : 0;
+		if (c == '|')
+			return 0;
+		if (c == '[') {
+			/* skip the bracket expression */
+			i += i + 1 < n && q[i+1] == '^';
+			i += i + 1 < n && q[i+1] == ']';
+			for (i++; i < n && q[i] != ']'; i++) {
+				if (q[i] != '[' || i + 1 == n ||
+				    !wcschr(L":.=", q[i+1]))
+					continue;
+				for (c = q[i+1], i += 2; i + 1 < n &&
+				     (q[i] != c || q[i+1] != ']'); i++)
+					;
+				i++;
+			}
+		} else if (depth > 0 || c == '(') {
+			depth += (c == '(') - (c == ')');
+			i += c == '\\';
+		} else if (c == '\\' && i + 1 < n && !iswalnum(q[i+1])) {
+			run[len++] = q[++i];
+			continue;
+		} else if (c == '\\') {
+			i++;
+		} else if (c == '*' || c == '?' || c == '{') {
+			/* the rune before may not be there */
+			len -= len > 0;
+			for (; c == '{' && i + 1 < n && q[i] != '}'; i++)
+				;
+		} else if (c && !wcschr(L".^$+)", c)) {
+			run[len++] = c;
+			continue;
+		}
+
+		if (len > best) {
+			memcpy(lit, run, len * sizeof(Rune));
+			best = len;
+		}
+		len = 0;
+	}
+	return best;
+}
+
+/* Take the changed query and look for it from where the search started. */
+void
+searchupdate(void)
+{
+	char pat[SEARCH_SIZ * UTF_SIZ + 1];
+	Rune lit[SEARCH_SIZ];
+	int i, n, len = 0;
+
+	srch.icase = 1;
+	for (i = 0; i < srch.qlen; i++) {
+		if (iswupper(srch.q[i]))
+			srch.icase = 0;
+	}
+	if (srch.recomp)
+		regfree(&srch.re);
+	srch.recomp = 0;
+	srch.status = SEARCH_OK;
+
+	if (srch.regex) {
+		for (i = 0; i < srch.qlen; i++)
+			len += utf8encode(srch.q[i], pat + len);
+		pat[len] = '\0';
+		if (regcomp(&srch.re, pat, REG_EXTENDED |
+		            (srch.icase ? REG_ICASE : 0))) {
+			srch.status = SEARCH_BADREGEX;
+		} else {
+			srch.recomp = 1;
+		}
+		n = searchliteral(srch.q, srch.qlen, lit);
+	} else {
+		memcpy(lit, srch.q, srch.qlen * sizeof(Rune));
+		n = srch.qlen;
+	}
+
+	/* the pairs of runes every match has */
+	srch.qsig = (Sig){ { 0, 0 } };
+	for (i = 1; i < n; i++) {
+		if (lit[i-1] != ' ' && lit[i] != ' ')
+			sigbit(&srch.qsig, searchfold(lit[i-1]),
+			       searchfold(lit[i]));
+	}
+
+	srch.found = 0;
+	searchindex();
+	if (srch.qlen > 0 && srch.status == SEARCH_OK &&
+	    searchfind(srch.origin, INT_MAX, 1)) {
+		searchshow();
+	} else {
+		if (srch.qlen > 0 && srch.status == SEARCH_OK)
+			srch.status = SEARCH_NOTFOUND;
+		searchback();
+	}
+	tfulldirt();
+}
+
+/* Start a search, of a regular expression if arg->i is set. */
+void
+searchstart(const Arg *arg)
+{
+	if (!srch.active) {
+		srch.active = 1;
+		srch.qlen = 0;
+		srch.scr = term.scr;
+		srch.origin = srch.pushed + term.row - 1 - term.scr;
+	}
+	srch.regex = arg->i;
+	searchupdate();
+}
+
+int
+searching(void)
+{
+	return srch.active;
+}
+
+/* Append the UTF-8 text s to the query. */
+void
+searchput(const char *s, int len)
+{
+	Rune u;
+	size_t n;
+
+	for (; len > 0 && srch.qlen < SEARCH_SIZ; s += n, len -= n) {
+		if (!(n = utf8decode(s, &u, len)))
+			break;
+		if (!ISCONTROL(u))
+			srch.q[srch.qlen++] = u;
+	}
+	searchupdate();
+}
+
+void
+searchdel(void)
+{
+	if (srch.qlen > 0) {
+		srch.qlen--;
+		searchupdate();
+	}
+}
+
+/* Go to the match before the current one if dir is 1, after it if -1. */
+void
+searchnext(int dir)
+{
+	uint64_t n = srch.found ? srch.at : srch.origin;
+	int x = srch.found ? srch.x1 : dir > 0 ? INT_MAX : -1;
+
+	if (srch.qlen == 0 || srch.status == SEARCH_BADREGEX)
+		return;
+	searchindex();
+	if (searchfind(n, x, dir)) {
+		srch.status = SEARCH_OK;
+		searchshow();
+	} else {
+		srch.status = SEARCH_NOTFOUND;
+	}
+	tsetdirt(term.row-1, term.row-1);
+}
+
+/*
+ * End the search. The view stays on the match, which becomes the
+ * primary selection, if keep is set, or goes back where it was.
+ */
+void
+searchend(int keep)
+{
+	srch.active = 0;
+	if (keep && srch.found)
+		xsetsel(getsel());
+	else
+		searchback();
+	tfulldirt();
+}
+
+/* Draw the query over l, the last row of the view. */
+void
+searchprompt(Line l)
+{
+	static const char *status[] = {
+		[SEARCH_NOTFOUND] = " (not found)",
+		[SEARCH_BADREGEX] = " (bad regex)",
+	};
+	const char *p = srch.regex ? "Regex: " : "Search: ";
+	Rune u;
+	int i, x, w;
+
+	for (x = 0; x < term.col; x++)
+		l[x] = (Glyph){ .u = ' ', .mode = ATTR_REVERSE };
+	for (x = 0; *p && x < term.col; p++)
+		l[x++].u = *p;
+	for (i = 0; i < srch.qlen && x < term.col; i++) {
+		u = srch.q[i];
+		if ((w = runewidth(u)) == 2 && x + 1 < term.col) {
+			l[x].mode |= ATTR_WIDE;
+			l[x+1].mode |= ATTR_WDUMMY;
+			l[x+1].u = 0;
+		} else if (w != 1) {
+			u = '?';
+			w = 1;
+		}
+		l[x].u = u;
+		x += w;
+	}
+	for (p = status[srch.status]; p && *p && x < term.col; p++)
+		l[x++].u = *p;
+}
+
+void
+tsetline(int y, Line l)
+{
+	int i = term.base + y;
+
+	if (term.line == term.alt) {
+		term.alt[y] = l;
+	} else {
+		i %= term.hot + term.row;
+		term.ring[i] = term.ring[i + term.hot + term.row] = l;
+	}
+}
+
+void
+tscrolldown(int orig, int n)
+{
+	int i;
+	Line temp;
+
+	LIMIT(n, 0, term.bot-orig+1);
+
+	tsetdirt(orig, term.bot-n);
+	tclearregion(0, term.bot-n+1, term.col-1, term.bot);
+
+	for (i = term.bot; i >= orig+n; i--) {
+		temp = term.line[i];
+		tsetline(i, term.line[i-n]);
+		tsetline(i-n, temp);
+	}
+
+	if (term.scr == 0)
+		selscroll(orig, n);
+}
+
+/*
+ * Pack the cells of l into buf and return the packed size. buf must have
+ * room for UTF_SIZ + 17 bytes per cell and 7 more. The line starts with
+ * the number of cells kept times two, plus one if the line wraps, as a
+ * varint. The cells follow as runs of equal attributes: the run length in
+ * two bytes, the mode, fg and bg as varints and the runes of the run in
+ * UTF-8. A zero length ends the line, trailing default blanks are
+ * dropped. Colors are kept as such so packed lines hold no pens.
+ */
+size_t
+linepack(uchar *buf, const Glyph *l, int col)
+{
+	static const Glyph blank[4] = {
+		{ .u = ' ' }, { .u = ' ' }, { .u = ' ' }, { .u = ' ' }
+	};
+	uchar *p = buf;
+	ulong v[3];
+	Pen pen;
+	int i, j, x;
+
+	while (col >= 4 && !memcmp(&l[col-4], blank, sizeof(blank)))
+		col -= 4;
+	while (col > 0 && !memcmp(&l[col-1], blank, sizeof(*blank)))
+		col--;
+
+	v[0] = (ulong)col << 1 | (col > 0 && l[col-1].mode & ATTR_WRAP);
+	for (; v[0] >= 0x80; v[0] >>= 7)
+		*p++ = v[0] | 0x80;
+	*p++ = v[0];
+
+	for (x = 0; x < col; x = j) {
+		for (j = x+1; j < col && j-x < 0xFFFF &&
+		     l[j].mode == l[x].mode && l[j].pen == l[x].pen; j++)
+			;
+		*p++ = (j-x) & 0xFF;
+		*p++ = (j-x) >> 8;
+		pen = term.pens[l[x].pen];
+		v[0] = l[x].mode;
+		v[1] = pen.fg;
+		v[2] = pen.bg;
+		for (i = 0; i < 3; i++) {
+			for (; v[i] >= 0x80; v[i] >>= 7)
+				*p++ = v[i] | 0x80;
+			*p++ = v[i];
+		}
+		for (i = x; i < j; i++) {
+			if (l[i].u < 0x80)
+				*p++ = l[i].u;
+			else
+				p += utf8encode(l[i].u, (char *)p);
+		}
+	}
+	*p++ = 0;
+	*p++ = 0;
+
+	return p - buf;
+}
+
+ulong
+linevarint(const uchar **p)
+{
+	const uchar *q = *p;
+	ulong v = 0;
+	int sh;
+
+	for (sh = 0; *q & 0x80; sh += 7)
+		v |= (ulong)(*q++ & 0x7F) << sh;
+	v |= (ulong)*q++ << sh;
+	*p = q;
+
+	return v;
+}
+
+void
+lineunpack(Glyph *l, int col, const uchar *p)
+{
+	ulong v[3];
+	Glyph g;
+	Rune u;
+	int i, x = 0, n;
+
+	linevarint(&p);
+	while ((n = p[0] | p[1] << 8)) {
+		p += 2;
+		for (i = 0; i < 3; i++)
+			v[i] = linevarint(&p);
+		g.mode = v[0];
+		g.pen = tinternpen(v[1], v[2]);
+		for (; n > 0; n--, x++) {
+			if (*p < 0x80) {
+				u = *p++;
+			} else {
+				p += utf8decode((const char *)p, &u, UTF_SIZ);
+			}
+			g.u = u;
+			if (x < col)
+				l[x] = g;
+		}
+	}
+	for (g = (Glyph){ .u = ' ' }; x < col; x++)
+		l[x] = g;
+}
+
+/*
+ * Add l to the history and return the line of the oldest history slot of
+ * the ring for reuse. When the history outgrows the ring, every line is
+ * also packed while it is still in cache. The ring then keeps the newest
+ * lines as cells and the packed copies of older ones are used instead.
+ */
+Line
+thistpush(Line l)
+{
+	Line old = term.ring[term.base + term.row];
+
+	if (!old)
+		old = xmalloc((term.col + 1) * sizeof(Glyph));
+	if (histsize > term.hot)
+		thistpack(l, term.col);
+	else
+		term.histn = MIN(term.histn + 1, histsize);
+	srch.pushed++;
+
+	return old;
+}
+
+/* Pack the history line l of col cells, dropping the oldest if full. */
+void
+thistpack(const Glyph *l, int col)
+{
+	HistBlock *b;
+	uchar **cold;
+	int i;
+	size_t need;
+	ulong seq;
+
+	if (term.coldn == term.coldcap && term.coldn < histsize) {
+		i = MIN(MAX(2 * term.coldcap, 256), histsize);
+		cold = xmalloc(i * sizeof(*cold));
+		for (seq = term.coldseq - term.coldn; seq < term.coldseq; seq++)
+			cold[seq % i] = term.cold[seq % term.coldcap];
+		free(term.cold);
+		term.cold = cold;
+		term.coldcap = i;
+	}
+	if (term.coldn == term.coldcap) {
+		/* drop the oldest line, freeing the blocks left empty */
+		for (b = term.blkhead; b->dropped == b->n; b = term.blkhead) {
+			term.blkhead = b->next;
+			free(b);
+		}
+		b->dropped++;
+		/* and the rows laid out from it */
+		seq = term.coldseq - term.coldn--;
+		if (seq >= term.rfseq)
+			term.histn--;
+		for (; term.rfn > 0 && term.rf[term.rfn-1].seq <= seq; term.rfn--)
+			term.histn--;
+	}
+
+	need = col * (UTF_SIZ + 17) + 7;
+	if (!term.blktail || term.blktail->size - term.blktail->len < need) {
+		b = xmalloc(sizeof(*b) + MAX(need, BLOCK_SIZ));
+		*b = (HistBlock){ .size = MAX(need, BLOCK_SIZ) };
+		if (term.blktail)
+			term.blktail->next = b;
+		else
+			term.blkhead = b;
+		term.blktail = b;
+	}
+	b = term.blktail;
+	term.cold[term.coldseq % term.coldcap] = b->buf + b->len;
+	b->len += linepack(b->buf + b->len, l, col);
+	b->n++;
+	term.coldseq++;
+	term.coldn++;
+	term.histn++;
+}
+
+/* Drop the n newest packed lines. */
+void
+thisttrunc(int n)
+{
+	HistBlock *b, *next, *prev = NULL;
+	uchar *p;
+
+	if (n <= 0)
+		return;
+	term.coldseq -= n;
+	term.coldn -= n;
+	if (term.coldn == 0) {
+		for (b = term.blkhead; b; b = next) {
+			next = b->next;
+			free(b);
+		}
+		term.blkhead = term.blktail = NULL;
+		return;
+	}
+
+	p = term.cold[term.coldseq % term.coldcap];
+	for (b = term.blkhead; p < b->buf || p >= b->buf + b->len; b = b->next)
+		prev = b;
+	for (next = b->next; next; next = b->next) {
+		n -= next->n;
+		b->next = next->next;
+		free(next);
+	}
+	b->n -= n;
+	b->len = p - b->buf;
+	term.blktail = b;
+	if (b->n == 0) {
+		/* there are older lines, so b is not the first block */
+		free(b);
+		prev->next = NULL;
+		term.blktail = prev;
+	}
+}
+
+/* Return history line k, 1 being the newest. */
+Line
+thistline(int k)
+{
+	const HistRow *r;
+	int i, end, n = term.histn - term.rfn;
+	ulong seq;
+
+	if (k <= term.hot && k <= n)
+		return term.ring[term.base + term.row + term.hot - k];
+
+	/*
+	 * Rows laid out from older lines are numbered down from rfseq and
+	 * may wrap around to the empty slot mark, they are not kept then.
+	 */
+	seq = k <= n ? term.coldseq - k : term.rfseq - (k - n);
+	i = seq % (term.row + 1);
+	if (seq + 1 && term.cacheseq[i] == seq + 1)
+		return term.cache[i];
+
+	if (k <= n) {
+		lineunpack(term.cache[i], term.col,
+		           term.cold[seq % term.coldcap]);
+	} else {
+		r = &term.rf[k - n - 1];
+		if (term.lbufseq != r->seq + 1)
+			thistload(r->seq);
+		end = tlinebreak(term.lbuf, term.lbuflen, r->off, term.col);
+		tlinefill(term.cache[i], term.col, term.lbuf + r->off,
+		          end - r->off, end < term.lbuflen);
+	}
+	term.cacheseq[i] = seq + 1;
+
+	return term.cache[i];
+}
+
+/*
+ * Make room for n more cells in term.lbuf and return where they go. New
+ * cells are zeroed, pengc() looks at all of them.
+ */
+Glyph *
+tlinegrow(int n)
+{
+	int cap = term.lbufcap;
+
+	if (!term.lbuf || term.lbuflen + n > cap) {
+		term.lbufcap = MAX(MAX(2 * cap, term.lbuflen + n), 256);
+		term.lbuf = xrealloc(term.lbuf,
+		                     term.lbufcap * sizeof(*term.lbuf));
+		memset(term.lbuf + cap, 0,
+		       (term.lbufcap - cap) * sizeof(*term.lbuf));
+	}
+	return term.lbuf + term.lbuflen;
+}
+
+/*
+ * Append a row of col cells to the logical line in term.lbuf, keeping at
+ * least keep of them. Trailing blanks are dropped, so is the cell a wide
+ * char wrapped over. Return 1 if the line goes on in the next row.
+ */
+int
+tlineappend(const Glyph *l, int col, int keep)
+{
+	int n = col, wrap = l[col-1].mode & ATTR_WRAP;
+
+	if (!wrap) {
+		while (n > keep && l[n-1].u == ' ')
+			n--;
+	} else if (l[col-1].mode & ATTR_WRAPPAD && keep < col) {
+		n--;
+	}
+	memcpy(tlinegrow(n), l, n * sizeof(Glyph));
+	term.lbuflen += n;
+	if (wrap && n == col)
+		term.lbuf[term.lbuflen-1].mode &= ~(ATTR_WRAP | ATTR_WRAPPAD);
+
+	return wrap != 0;
+}
+
+/*
+ * Load the logical line starting at packed line seq into term.lbuf. It
+ * ends with the first line that doesn't wrap or at rfseq.
+ */
+void
+thistload(ulong seq)
+{
+	const uchar *p;
+	Glyph *g;
+	ulong h;
+	int n;
+
+	term.lbufseq = seq + 1;
+	term.lbuflen = 0;
+	do {
+		p = term.cold[seq % term.coldcap];
+		h = linevarint(&p);
+		n = h >> 1;
+		lineunpack(tlinegrow(n), n, term.cold[seq % term.coldcap]);
+		if (h & 1) {
+			g = &term.lbuf[term.lbuflen + n - 1];
+			if (g->mode & ATTR_WRAPPAD)
+				n--;
+			else
+				g->mode &= ~ATTR_WRAP;
+		}
+		term.lbuflen += n;
+	} while (h & 1 && ++seq < term.rfseq);
+}
+
+/*
+ * Return the end of the row starting at cell off of a logical line that
+ * ends at cell len, for col columns. A wide char never starts in the
+ * last column.
+ */
+int
+tlinebreak(const Glyph *l, int len, int off, int col)
+{
+	int end = MIN(off + col, len);
+
+	if (end - off == col && col > 1 && l[end-1].mode & ATTR_WIDE)
+		end--;
+	return end;
+}
+
+/* Fill l with the n cells of a laid out row, marking it if it wraps. */
+void
+tlinefill(Line l, int col, const Glyph *g, int n, int wrap)
 {
-	int n = a->i;
-
-	if (n < 0)
-		n = term.row + n;
+	int x;
 
-	if (term.scr <= HISTSIZE-n) {
-		term.scr += n;
-		selscroll(0, n);
-		tfulldirt();
-	}
+	memcpy(l, g, n * sizeof(Glyph));
+	for (x = n; x < col; x++)
+		l[x] = (Glyph){ .u = ' ' };
+	if (wrap)
+		l[col-1].mode |= ATTR_WRAP | (n < col ? ATTR_WRAPPAD : 0);
 }
 
-void
-tscrolldown(int orig, int n, int copyhist)
+/*
+ * Lay out the next older logical line of those packed before rfseq at
+ * the current width and add its rows to term.rf. Return 0 if there are
+ * no lines left.
+ */
+int
+thistreflow(void)
 {
-	int i;
-	Line temp;
+	ulong seq = term.rfnext, old = term.coldseq - term.coldn;
+	int i, n, off;
 
-	LIMIT(n, 0, term.bot-orig+1);
+	if (seq <= old)
+		return 0;
+	for (seq--; seq > old && *term.cold[(seq-1) % term.coldcap] & 1; seq--)
+		;
+	thistload(seq);
+	for (n = 0, off = 0; n == 0 || off < term.lbuflen; n++)
+		off = tlinebreak(term.lbuf, term.lbuflen, off, term.col);
 
-	if (copyhist) {
-		term.histi = (term.histi - 1 + HISTSIZE) % HISTSIZE;
-		temp = term.hist[term.histi];
-		term.hist[term.histi] = term.line[term.bot];
-		term.line[term.bot] = temp;
+	if (term.rfn + n > term.rfcap) {
+		term.rfcap = MAX(2 * term.rfcap, term.rfn + n);
+		term.rf = xrealloc(term.rf, term.rfcap * sizeof(*term.rf));
+	}
+	for (i = n-1, off = 0; i >= 0; i--) {
+		term.rf[term.rfn + i] = (HistRow){ .seq = seq, .off = off };
+		off = tlinebreak(term.lbuf, term.lbuflen, off, term.col);
 	}
+	term.rfn += n;
+	term.histn += n;
+	term.rfnext = seq;
 
-	tsetdirt(orig, term.bot-n);
-	tclearregion(0, term.bot-n+1, term.col-1, term.bot);
+	return 1;
+}
 
-	for (i = term.bot; i >= orig+n; i--) {
-		temp = term.line[i];
-		term.line[i] = term.line[i-n];
-		term.line[i-n] = temp;
+/*
+ * Scroll the region from orig to term.bot up by one line and move the line
+ * at orig into the history. The oldest history slot is reused for the new
+ * bottom line. On the main screen only the rows outside of the region move,
+ * so scrolling the whole screen just advances term.base.
+ */
+void
+tscrollhist(int orig)
+{
+	int y, sz = term.hot + term.row;
+	Line l = term.line[orig], old = thistpush(l);
+
+	tsetline(orig, old);
+	tclearregion(0, orig, term.col-1, orig);
+	tsetdirt(orig+1, term.bot);
+
+	if (term.line == term.alt) {
+		for (y = orig; y < term.bot; y++)
+			term.alt[y] = term.alt[y+1];
+		term.alt[term.bot] = old;
+		/* make room for l in front of the main screen */
+		for (y = term.row-1; y >= 0; y--)
+			term.ring[(term.base+y+1) % sz] =
+			term.ring[(term.base+y+1) % sz + sz] =
+				term.ring[term.base+y];
+		term.ring[term.base] = term.ring[term.base + sz] = l;
+		term.base = (term.base + 1) % sz;
+		return;
 	}
 
-	if (term.scr == 0)
-		selscroll(orig, n);
+	for (y = orig-1; y >= 0; y--)
+		tsetline(y+1, term.line[y]);
+	tsetline(0, l);
+	for (y = term.row-1; y > term.bot; y--)
+		tsetline(y+1, term.line[y]);
+	tsetline(term.bot+1, old);
+	term.base = (term.base + 1) % sz;
+	term.line = &term.ring[term.base];
 }
 
 void
@@ -1133,25 +2903,22 @@ tscrollup(int orig, int n, int copyhist)
 
 	LIMIT(n, 0, term.bot-orig+1);
 
-	if (copyhist) {
-		term.histi = (term.histi + 1) % HISTSIZE;
-		temp = term.hist[term.histi];
-		term.hist[term.histi] = term.line[orig];
-		term.line[orig] = temp;
-	}
-
-	if (term.scr > 0 && term.scr < HISTSIZE)
-		term.scr = MIN(term.scr + n, HISTSIZE-1);
-
-	tclearregion(0, orig, term.col-1, orig+n-1);
-	tsetdirt(orig+n, term.bot);
+	if (copyhist && term.hot > 0) {
+		for (i = 0; i < n; i++)
+			tscrollhist(orig);
+	} else {
+		tclearregion(0, orig, term.col-1, orig+n-1);
+		tsetdirt(orig+n, term.bot);
 
-	for (i = orig; i <= term.bot-n; i++) {
-		temp = term.line[i];
-		term.line[i] = term.line[i+n];
-		term.line[i+n] = temp;
+		for (i = orig; i <= term.bot-n; i++) {
+			temp = term.line[i];
+			tsetline(i, term.line[i+n]);
+			tsetline(i+n, temp);
+		}
 	}
 
+	if (term.scr > 0)
+		term.scr = MIN(term.scr + n, term.histn);
 	if (term.scr == 0)
 		selscroll(orig, -n);
 }
@@ -1189,34 +2956,93 @@ tnewline(int first_col)
 	tmoveto(first_col ? 0 : term.c.x, y);
 }
 
-void
-csiparse(void)
+/*
+ * Read the next byte of a CSI sequence, return 1 when it is complete.
+ * Arguments are accumulated as the digits come, so a sequence is handled
+ * as soon as its final byte is read. mode[0] is the first byte that is
+ * not part of the arguments, mode[1] the one after it.
+ */
+int
+csiput(Rune u)
 {
-	char *p = csiescseq.buf, *np;
-	long int v;
-
-	csiescseq.narg = 0;
-	if (*p == '?') {
-		csiescseq.priv = 1;
-		p++;
-	}
-
-	csiescseq.buf[csiescseq.len] = '\0';
-	while (p < csiescseq.buf+csiescseq.len) {
-		np = NULL;
-		v = strtol(p, &np, 10);
-		if (np == p)
-			v = 0;
-		if (v == LONG_MAX || v == LONG_MIN)
-			v = -1;
-		csiescseq.arg[csiescseq.narg++] = v;
-		p = np;
-		if (*p != ';' || csiescseq.narg == ESC_ARG_SIZ)
-			break;
-		p++;
+	static const struct {
+		uchar next, action;
+	} trans[][CC_FINAL + 1] = {
+		[CSI_ENTRY] = {
+			[CC_DIGIT] = { CSI_PARAM,  CA_DIGIT },
+			[CC_SEP]   = { CSI_PARAM,  CA_SEP },
+			[CC_PRIV]  = { CSI_PARAM,  CA_PRIV },
+			[CC_OTHER] = { CSI_MODE,   CA_MODE0 },
+			[CC_FINAL] = { CSI_MODE,   CA_MODE0 },
+		},
+		[CSI_PARAM] = {
+			[CC_DIGIT] = { CSI_PARAM,  CA_DIGIT },
+			[CC_SEP]   = { CSI_PARAM,  CA_SEP },
+			[CC_PRIV]  = { CSI_MODE,   CA_MODE0 },
+			[CC_OTHER] = { CSI_MODE,   CA_MODE0 },
+			[CC_FINAL] = { CSI_MODE,   CA_MODE0 },
+		},
+		[CSI_MODE] = {
+			[CC_DIGIT] = { CSI_IGNORE, CA_MODE1 },
+			[CC_SEP]   = { CSI_IGNORE, CA_MODE1 },
+			[CC_PRIV]  = { CSI_IGNORE, CA_MODE1 },
+			[CC_OTHER] = { CSI_IGNORE, CA_MODE1 },
+			[CC_FINAL] = { CSI_IGNORE, CA_MODE1 },
+		},
+		[CSI_IGNORE] = {
+			[CC_DIGIT] = { CSI_IGNORE, CA_NONE },
+			[CC_SEP]   = { CSI_IGNORE, CA_NONE },
+			[CC_PRIV]  = { CSI_IGNORE, CA_NONE },
+			[CC_OTHER] = { CSI_IGNORE, CA_NONE },
+			[CC_FINAL] = { CSI_IGNORE, CA_NONE },
+		},
+	};
+	CSIEscape *c = &csiescseq;
+	int class, *a;
+
+	if (BETWEEN(u, '0', '9'))
+		class = CC_DIGIT;
+	else if (u == ';')
+		class = CC_SEP;
+	else if (u == '?')
+		class = CC_PRIV;
+	else if (BETWEEN(u, 0x40, 0x7E))
+		class = CC_FINAL;
+	else
+		class = CC_OTHER;
+
+	/* a sequence has at least one argument, 0 if it is empty */
+	if (c->narg == 0)
+		c->narg = 1;
+	switch (trans[c->state][class].action) {
+	case CA_DIGIT:
+		a = &c->arg[c->narg-1];
+		if (*a <= (INT_MAX - 9) / 10)
+			*a = *a * 10 + (u - '0');
+		break;
+	case CA_SEP:
+		if (c->narg == ESC_ARG_SIZ) {
+			c->mode[0] = u;
+			c->state = CSI_MODE;
+			goto next;
+		}
+		c->narg++;
+		break;
+	case CA_PRIV:
+		c->priv = 1;
+		break;
+	case CA_MODE0:
+		c->mode[0] = u;
+		break;
+	case CA_MODE1:
+		c->mode[1] = u;
+		break;
 	}
-	csiescseq.mode[0] = *p++;
-	csiescseq.mode[1] = (p < csiescseq.buf+csiescseq.len) ? *p : '\0';
+	c->state = trans[c->state][class].next;
+next:
+	c->buf[c->len++] = u;
+
+	return class == CC_FINAL || c->len >= sizeof(c->buf)-1;
 }
 
 /* for absolute user moves, when decom is set */
@@ -1269,12 +3095,19 @@ tsetchar(Rune u, const Glyph *attr, int x, int y)
 			term.line[y][x+1].u = ' ';
 			term.line[y][x+1].mode &= ~ATTR_WDUMMY;
 		}
-	} else if (term.line[y][x].mode & ATTR_WDUMMY) {
+	} else if ((term.line[y][x].mode & ATTR_WDUMMY) && x > 0) {
+		/* a DCH may have left it at the start, without its char */
 		term.line[y][x-1].u = ' ';
 		term.line[y][x-1].mode &= ~ATTR_WIDE;
 	}
 
-	term.dirty[y] = 1;
+	if ((term.line[y][x].mode | attr->mode) & ATTR_BLINK) {
+		TBLINKS(term.line[y]) += ((attr->mode & ATTR_BLINK) != 0) -
+		                  ((term.line[y][x].mode & ATTR_BLINK) != 0);
+	}
+
+	/* a wide char cleared on either side is drawn again as well */
+	tsetdirtspan(y, x-1, x+2);
 	term.line[y][x] = *attr;
 	term.line[y][x].u = u;
 }
@@ -1282,8 +3115,9 @@ tsetchar(Rune u, const Glyph *attr, int x, int y)
 void
 tclearregion(int x1, int y1, int x2, int y2)
 {
-	int x, y, temp;
-	Glyph *gp;
+	int y, temp;
+	Glyph *gp, blank = { .u = ' ', .mode = 0, .pen = term.c.attr.pen };
+	Span s;
 
 	if (x1 > x2)
 		temp = x1, x1 = x2, x2 = temp;
@@ -1296,16 +3130,18 @@ tclearregion(int x1, int y1, int x2, int y2)
 	LIMIT(y2, 0, term.row-1);
 
 	for (y = y1; y <= y2; y++) {
-		term.dirty[y] = 1;
-		for (x = x1; x <= x2; x++) {
-			gp = &term.line[y][x];
-			if (selected(x, y))
-				selclear();
-			gp->fg = term.c.attr.fg;
-			gp->bg = term.c.attr.bg;
-			gp->mode = 0;
-			gp->u = ' ';
+		tsetdirtspan(y, x1, x2+1);
+		s = selspan(y);
+		if (MAX(s.x1, x1) < MIN(s.x2, x2+1))
+			selclear();
+		if (x1 == 0 && x2 == term.col-1) {
+			TBLINKS(term.line[y]) = 0;
+		} else if (TBLINKS(term.line[y])) {
+			for (gp = &term.line[y][x1]; gp <= &term.line[y][x2]; gp++)
+				TBLINKS(term.line[y]) -= (gp->mode & ATTR_BLINK) != 0;
 		}
+		for (gp = &term.line[y][x1]; gp <= &term.line[y][x2]; gp++)
+			*gp = blank;
 	}
 }
 
@@ -1313,6 +3149,7 @@ void
 tdeletechar(int n)
 {
 	int dst, src, size;
+	Rune blinks;
 	Glyph *line;
 
 	LIMIT(n, 0, term.col - term.c.x);
@@ -1321,15 +3158,20 @@ tdeletechar(int n)
 	src = term.c.x + n;
 	size = term.col - src;
 	line = term.line[term.c.y];
+	blinks = TBLINKS(line);
 
 	memmove(&line[dst], &line[src], size * sizeof(Glyph));
+	tsetdirtspan(term.c.y, dst, term.col);
 	tclearregion(term.col-n, term.c.y, term.col-1, term.c.y);
+	if (blinks)
+		TBLINKS(line) = tblinkcount(line);
 }
 
 void
 tinsertblank(int n)
 {
 	int dst, src, size;
+	Rune blinks;
 	Glyph *line;
 
 	LIMIT(n, 0, term.col - term.c.x);
@@ -1338,16 +3180,20 @@ tinsertblank(int n)
 	src = term.c.x;
 	size = term.col - dst;
 	line = term.line[term.c.y];
+	blinks = TBLINKS(line);
 
 	memmove(&line[dst], &line[src], size * sizeof(Glyph));
+	tsetdirtspan(term.c.y, src, term.col);
 	tclearregion(src, term.c.y, dst - 1, term.c.y);
+	if (blinks)
+		TBLINKS(line) = tblinkcount(line);
 }
 
 void
 tinsertblankline(int n)
 {
 	if (BETWEEN(term.c.y, term.top, term.bot))
-		tscrolldown(term.c.y, n, 0);
+		tscrolldown(term.c.y, n);
 }
 
 void
@@ -1412,6 +3258,8 @@ tsetattr(const int *attr, int l)
 {
 	int i;
 	int32_t idx;
+	Pen pen = term.pens[term.c.attr.pen];
+	uint32_t fg = pen.fg, bg = pen.bg;
 
 	for (i = 0; i < l; i++) {
 		switch (attr[i]) {
@@ -1425,8 +3273,8 @@ tsetattr(const int *attr, int l)
 				ATTR_REVERSE    |
 				ATTR_INVISIBLE  |
 				ATTR_STRUCK     );
-			term.c.attr.fg = defaultfg;
-			term.c.attr.bg = defaultbg;
+			fg = defaultfg;
+			bg = defaultbg;
 			break;
 		case 1:
 			term.c.attr.mode |= ATTR_BOLD;
@@ -1477,27 +3325,27 @@ tsetattr(const int *attr, int l)
 			break;
 		case 38:
 			if ((idx = tdefcolor(attr, &i, l)) >= 0)
-				term.c.attr.fg = idx;
+				fg = idx;
 			break;
 		case 39:
-			term.c.attr.fg = defaultfg;
+			fg = defaultfg;
 			break;
 		case 48:
 			if ((idx = tdefcolor(attr, &i, l)) >= 0)
-				term.c.attr.bg = idx;
+				bg = idx;
 			break;
 		case 49:
-			term.c.attr.bg = defaultbg;
+			bg = defaultbg;
 			break;
 		default:
 			if (BETWEEN(attr[i], 30, 37)) {
-				term.c.attr.fg = attr[i] - 30;
+				fg = attr[i] - 30;
 			} else if (BETWEEN(attr[i], 40, 47)) {
-				term.c.attr.bg = attr[i] - 40;
+				bg = attr[i] - 40;
 			} else if (BETWEEN(attr[i], 90, 97)) {
-				term.c.attr.fg = attr[i] - 90 + 8;
+				fg = attr[i] - 90 + 8;
 			} else if (BETWEEN(attr[i], 100, 107)) {
-				term.c.attr.bg = attr[i] - 100 + 8;
+				bg = attr[i] - 100 + 8;
 			} else {
 				fprintf(stderr,
 					"erresc(default): gfx attr %d unknown\n",
@@ -1507,6 +3355,7 @@ tsetattr(const int *attr, int l)
 			break;
 		}
 	}
+	term.c.attr.pen = tinternpen(fg, bg);
 }
 
 void
@@ -1795,7 +3644,7 @@ csihandle(void)
 		break;
 	case 'T': /* SD -- Scroll <n> line down */
 		DEFAULT(csiescseq.arg[0], 1);
-		tscrolldown(term.top, csiescseq.arg[0], 0);
+		tscrolldown(term.top, csiescseq.arg[0]);
 		break;
 	case 'L': /* IL -- Insert <n> blank lines */
 		DEFAULT(csiescseq.arg[0], 1);
@@ -1901,7 +3750,12 @@ csidump(void)
 void
 csireset(void)
 {
-	memset(&csiescseq, 0, sizeof(csiescseq));
+	csiescseq.len = 0;
+	csiescseq.priv = 0;
+	memset(csiescseq.arg, 0, sizeof(csiescseq.arg));
+	csiescseq.narg = 0;
+	csiescseq.mode[0] = csiescseq.mode[1] = '\0';
+	csiescseq.state = CSI_ENTRY;
 }
 
 void
@@ -1963,12 +3817,13 @@ strhandle(void)
 			return;
 		case 52:
 			if (narg > 2 && allowwindowops) {
-				dec = base64dec(strescseq.args[2]);
+				dec = base64end(&strescseq.b64);
 				if (dec) {
 					xsetsel(dec);
 					xclipcopy();
 				} else {
-					fprintf(stderr, "erresc: invalid base64\n");
+					fprintf(stderr, "erresc: OSC 52 text longer "
+					        "than osc52max\n");
 				}
 			}
 			return;
@@ -2079,9 +3934,68 @@ strdump(void)
 	fprintf(stderr, "ESC\\\n");
 }
 
+/*
+ * Append s to the STR sequence. The text of OSC 52 is decoded as it
+ * arrives instead, once the selection argument before it is complete.
+ */
+void
+tstrput(const char *s, size_t n)
+{
+	const char *p;
+	size_t m;
+	int args = 0;
+
+	if (strescseq.b64.state != B64_OFF) {
+		base64put(&strescseq.b64, s, n);
+		return;
+	}
+
+	m = n;
+	if (strescseq.type == ']' && strescseq.nsemi < 2) {
+		for (p = s; (p = memchr(p, ';', s + n - p)); p++) {
+			if (++strescseq.nsemi == 2) {
+				m = p + 1 - s;
+				args = 1;
+				break;
+			}
+		}
+	}
+
+	while (strescseq.len+m >= strescseq.siz) {
+		/*
+		 * Here is a bug in terminals. If the user never sends
+		 * some code to stop the str or esc command, then st
+		 * will stop responding. But this is better than
+		 * silently failing with unknown characters. At least
+		 * then users will report back.
+		 *
+		 * In the case users ever get fixed, here is the code:
+		 */
+		/*
+		 * term.esc = 0;
+		 * strhandle();
+		 */
+		if (strescseq.siz > (SIZE_MAX - UTF_SIZ) / 2)
+			return;
+		strescseq.siz *= 2;
+		strescseq.buf = xrealloc(strescseq.buf, strescseq.siz);
+	}
+
+	memmove(&strescseq.buf[strescseq.len], s, m);
+	strescseq.len += m;
+
+	if (args) {
+		/* atoi() stops at the first ';', as in strhandle() */
+		if (atoi(strescseq.buf) == 52)
+			strescseq.b64.state = allowwindowops ? B64_ON : B64_END;
+		tstrput(s + m, n - m);
+	}
+}
+
 void
 strreset(void)
 {
+	free(strescseq.b64.buf);
 	strescseq = (STREscape){
 		.buf = xrealloc(strescseq.buf, STR_BUF_SIZ),
 		.siz = STR_BUF_SIZ,
@@ -2126,12 +4040,12 @@ printsel(const Arg *arg)
 void
 tdumpsel(void)
 {
-	char *ptr;
+	const char *ptr;
+	size_t n;
+	int y = sel.nb.y;
 
-	if ((ptr = getsel())) {
-		tprinter(ptr, strlen(ptr));
-		free(ptr);
-	}
+	while ((ptr = selread(&y, &n)))
+		tprinter((char *)ptr, n);
 }
 
 void
@@ -2380,7 +4294,7 @@ eschandle(uchar ascii)
 		break;
 	case 'M': /* RI -- Reverse index */
 		if (term.c.y == term.top) {
-			tscrolldown(term.top, 1, 1);
+			tscrolldown(term.top, 1);
 		} else {
 			tmoveto(term.c.x, term.c.y-1);
 		}
@@ -2432,7 +4346,7 @@ tputc(Rune u)
 		width = len = 1;
 	} else {
 		len = utf8encode(u, c);
-		if (!control && (width = wcwidth(u)) == -1)
+		if (!control && (width = runewidth(u)) == -1)
 			width = 1;
 	}
 
@@ -2453,28 +4367,7 @@ tputc(Rune u)
 			goto check_control_code;
 		}
 
-		if (strescseq.len+len >= strescseq.siz) {
-			/*
-			 * Here is a bug in terminals. If the user never sends
-			 * some code to stop the str or esc command, then st
-			 * will stop responding. But this is better than
-			 * silently failing with unknown characters. At least
-			 * then users will report back.
-			 *
-			 * In the case users ever get fixed, here is the code:
-			 */
-			/*
-			 * term.esc = 0;
-			 * strhandle();
-			 */
-			if (strescseq.siz > (SIZE_MAX - UTF_SIZ) / 2)
-				return;
-			strescseq.siz *= 2;
-			strescseq.buf = xrealloc(strescseq.buf, strescseq.siz);
-		}
-
-		memmove(&strescseq.buf[strescseq.len], c, len);
-		strescseq.len += len;
+		tstrput(c, len);
 		return;
 	}
 
@@ -2497,12 +4390,8 @@ check_control_code:
 		return;
 	} else if (term.esc & ESC_START) {
 		if (term.esc & ESC_CSI) {
-			csiescseq.buf[csiescseq.len++] = u;
-			if (BETWEEN(u, 0x40, 0x7E)
-					|| csiescseq.len >= \
-					sizeof(csiescseq.buf)-1) {
+			if (csiput(u)) {
 				term.esc = 0;
-				csiparse();
 				csihandle();
 			}
 			return;
@@ -2529,7 +4418,8 @@ check_control_code:
 
 	gp = &term.line[term.c.y][term.c.x];
 	if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
-		gp->mode |= ATTR_WRAP;
+		/* the last column, the cursor may be on a wide char before */
+		term.line[term.c.y][term.col-1].mode |= ATTR_WRAP;
 		tnewline(1);
 		gp = &term.line[term.c.y][term.c.x];
 	}
@@ -2537,13 +4427,21 @@ check_control_code:
 	if (IS_SET(MODE_INSERT) && term.c.x+width < term.col) {
 		memmove(gp+width, gp, (term.col - term.c.x - width) * sizeof(Glyph));
 		gp->mode &= ~ATTR_WIDE;
+		if (TBLINKS(term.line[term.c.y])) {
+			TBLINKS(term.line[term.c.y]) =
+				tblinkcount(term.line[term.c.y]);
+		}
+		tsetdirtspan(term.c.y, term.c.x, term.col);
 	}
 
 	if (term.c.x+width > term.col) {
-		if (IS_SET(MODE_WRAP))
+		if (IS_SET(MODE_WRAP)) {
+			/* the line goes on, but without the cell left over */
+			gp->mode |= ATTR_WRAP | ATTR_WRAPPAD;
 			tnewline(1);
-		else
+		} else {
 			tmoveto(term.col - width, term.c.y);
+		}
 		gp = &term.line[term.c.y][term.c.x];
 	}
 
@@ -2552,11 +4450,14 @@ check_control_code:
 
 	if (width == 2) {
 		gp->mode |= ATTR_WIDE;
+		tsetdirtspan(term.c.y, term.c.x, term.c.x+3);
 		if (term.c.x+1 < term.col) {
 			if (gp[1].mode == ATTR_WIDE && term.c.x+2 < term.col) {
 				gp[2].u = ' ';
 				gp[2].mode &= ~ATTR_WDUMMY;
 			}
+			if (gp[1].mode & ATTR_BLINK)
+				TBLINKS(term.line[term.c.y])--;
 			gp[1].u = '\0';
 			gp[1].mode = ATTR_WDUMMY;
 		}
@@ -2568,45 +4469,336 @@ check_control_code:
 	}
 }
 
+/*
+ * Print a run of printable single-width runes. The result is the same as
+ * calling tputc() for each of them, but the escape state, the selection
+ * and the line are only looked at once per run instead of once per rune.
+ */
+void
+tputrun(const Rune *u, int n)
+{
+	int i, k, x, y;
+	Glyph *gp;
+	Span s;
+
+	if (IS_SET(MODE_PRINT|MODE_INSERT) ||
+	    term.trantbl[term.charset] == CS_GRAPHIC0) {
+		while (n-- > 0)
+			tputc(*u++);
+		return;
+	}
+
+	while (n > 0) {
+		if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
+			term.line[term.c.y][term.col-1].mode |= ATTR_WRAP;
+			tnewline(1);
+		}
+		x = term.c.x;
+		y = term.c.y;
+		k = MIN(n, term.col - x);
+
+		s = selspan(y);
+		if (MAX(s.x1, x) < MIN(s.x2, x + k))
+			selclear();
+
+		gp = &term.line[y][x];
+		if (TBLINKS(term.line[y]) || (term.c.attr.mode & ATTR_BLINK)) {
+			for (i = 0; i < k; i++) {
+				TBLINKS(term.line[y]) +=
+					((term.c.attr.mode & ATTR_BLINK) != 0) -
+					((gp[i].mode & ATTR_BLINK) != 0);
+			}
+		}
+		for (i = 0; i < k; i++, gp++) {
+			/* same wide character cleanup as tsetchar() */
+			if (gp->mode & ATTR_WIDE) {
+				if (x+i+1 < term.col) {
+					gp[1].u = ' ';
+					gp[1].mode &= ~ATTR_WDUMMY;
+				}
+			} else if ((gp->mode & ATTR_WDUMMY) && x+i > 0) {
+				gp[-1].u = ' ';
+				gp[-1].mode &= ~ATTR_WIDE;
+			}
+			*gp = term.c.attr;
+			gp->u = u[i];
+		}
+		tsetdirtspan(y, x-1, x+k+1);
+		term.lastc = u[k-1];
+		u += k;
+		n -= k;
+
+		if (x+k < term.col) {
+			tmoveto(x+k, y);
+		} else {
+			term.c.x = term.col-1;
+			term.c.state |= CURSOR_WRAPNEXT;
+		}
+	}
+}
+
+/*
+ * Read the CSI sequences at the start of u, along with the ESC [ they
+ * start with, without going through tputc(). Stop at anything else and
+ * return the number of runes read.
+ */
+int
+tcsirun(const Rune *u, int n)
+{
+	int i;
+
+	for (i = 0; i < n && !IS_SET(MODE_PRINT); i++) {
+		if (term.esc == 0 && u[i] == '\033') {
+			csireset();
+			term.esc = ESC_START;
+		} else if (term.esc == ESC_START && u[i] == '[') {
+			term.esc |= ESC_CSI;
+		} else if (term.esc == (ESC_START|ESC_CSI) &&
+		           !ISCONTROL(u[i])) {
+			if (csiput(u[i])) {
+				term.esc = 0;
+				csihandle();
+			}
+		} else {
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * Put the printable ASCII runes at the start of u into the STR sequence
+ * in one go and return their number.
+ */
+int
+tstrrun(const Rune *u, int n)
+{
+	char buf[RUN_SIZ];
+	int i;
+
+	if (IS_SET(MODE_PRINT))
+		return 0;
+	for (i = 0; i < n && i < LEN(buf) && BETWEEN(u[i], ' ', '~'); i++)
+		buf[i] = u[i];
+	tstrput(buf, i);
+	return i;
+}
+
 int
 twrite(const char *buf, int buflen, int show_ctrl)
 {
-	int charsize;
-	Rune u;
-	int n;
-
-	for (n = 0; n < buflen; n += charsize) {
-		if (IS_SET(MODE_UTF8)) {
-			/* process a complete utf8 char */
-			charsize = utf8decode(buf + n, &u, buflen - n);
-			if (charsize == 0)
+	Rune u, runes[RUN_SIZ];
+	size_t i, j, nrunes, used;
+	int n, utf8, width;
+
+	for (n = 0; n < buflen; n += used) {
+		utf8 = IS_SET(MODE_UTF8);
+		if (utf8) {
+			/* decode as many complete utf8 chars as fit */
+			nrunes = utf8decodebuf(buf + n, buflen - n, runes,
+			                       LEN(runes), &used);
+			if (nrunes == 0)
 				break;
 		} else {
-			u = buf[n] & 0xFF;
-			charsize = 1;
-		}
-		if (show_ctrl && ISCONTROL(u)) {
-			if (u & 0x80) {
-				u &= 0x7f;
-				tputc('^');
-				tputc('[');
-			} else if (u != '\n' && u != '\r' && u != '\t') {
-				u ^= 0x40;
-				tputc('^');
+			nrunes = used = MIN(buflen - n, LEN(runes));
+			for (i = 0; i < nrunes; i++)
+				runes[i] = buf[n + i] & 0xFF;
+		}
+
+		for (i = 0; i < nrunes; i = j) {
+			/*
+			 * Printable runes outside of a sequence are written
+			 * in one go by tputrun().
+			 */
+			for (j = i; j < nrunes && !term.esc; j++) {
+				u = runes[j];
+				if (ISCONTROL(u))
+					break;
+				if (utf8 && u >= 127 && (width = runewidth(u)) != 1
+				    && width != -1)
+					break;
+			}
+			if (j > i) {
+				tputrun(runes + i, j - i);
+				continue;
+			}
+			/* and so are CSI sequences and the text of others */
+			if (!show_ctrl && (j = i + tcsirun(runes + i,
+			                                   nrunes - i)) > i)
+				continue;
+			if (term.esc & ESC_STR && (j = i + tstrrun(runes + i,
+			                                           nrunes - i)) > i)
+				continue;
+
+			u = runes[j++];
+			if (show_ctrl && ISCONTROL(u)) {
+				if (u & 0x80) {
+					u &= 0x7f;
+					tputc('^');
+					tputc('[');
+				} else if (u != '\n' && u != '\r' && u != '\t') {
+					u ^= 0x40;
+					tputc('^');
+				}
+			}
+			tputc(u);
+
+			/* the rest has to be decoded again if utf8 was toggled */
+			if (IS_SET(MODE_UTF8) != utf8) {
+				for (used = 0; j-- > 0; used += utf8 ?
+				     utf8decode(buf + n + used, &u,
+				                buflen - n - used) : 1)
+					;
+				break;
 			}
 		}
-		tputc(u);
 	}
+
 	return n;
 }
 
+/*
+ * Lay out the main screen and the newest history lines again for col
+ * columns and row rows. Rows joined by ATTR_WRAP are taken as one logical
+ * line and the cursor stays on its cell. The screen keeps its first line
+ * at the top unless the cursor would fall off, then lines go into the
+ * history. Older history lines are laid out as they are scrolled to, see
+ * thistreflow().
+ */
+void
+treflow(int col, int row)
+{
+	TCursor *c = IS_SET(MODE_ALTSCREEN) ? &term.sc[0] : &term.c;
+	Line *ring, *scr = &term.ring[term.base], l, tmp;
+	int cx = MIN(c->x, term.col-1), cy = MIN(c->y, term.row-1);
+	int wrapnext = c->state & CURSOR_WRAPNEXT;
+	int n1 = term.histn - term.rfn, cold = histsize > term.hot;
+	int *ends, nends = 0, top = 0, cur = 0, topoff = 0, curoff = 0;
+	int i, j, k, m, x, y, off, end, last, rows, first, s0 = -1, cr = -1;
+
+	/* history lines kept as cells and those their first line continues */
+	for (m = MIN(term.hot, n1); m < n1 &&
+	     thistline(m+1)[term.col-1].mode & ATTR_WRAP; m++)
+		;
+	/* rows below the cursor and the last text are left out */
+	for (last = term.row-1; last > cy; last--) {
+		for (x = 0; x < term.col && scr[last][x].u == ' '; x++)
+			;
+		if (x < term.col)
+			break;
+	}
+
+	ends = xmalloc((m + last + 1) * sizeof(*ends));
+	term.lbuflen = 0;
+	for (k = m; k > 0; k--) {
+		if (!tlineappend(thistline(k), term.col, 0))
+			ends[nends++] = term.lbuflen;
+	}
+	for (y = 0; y <= last; y++) {
+		if (y == 0) {
+			top = nends;
+			topoff = term.lbuflen;
+		}
+		if (y == cy) {
+			cur = nends;
+			curoff = term.lbuflen + cx;
+		}
+		if (!tlineappend(scr[y], term.col, y == cy ? cx + 1 : 0) ||
+		    y == last)
+			ends[nends++] = term.lbuflen;
+	}
+
+	/* find the rows of the first screen line and of the cursor */
+	for (i = 0, rows = 0, off = 0; i < nends; i++) {
+		do {
+			end = tlinebreak(term.lbuf, ends[i], off, col);
+			if (i == top && s0 < 0 &&
+			    (topoff < end || end == ends[i]))
+				s0 = rows;
+			if (i == cur && cr < 0 &&
+			    (curoff < end || end == ends[i])) {
+				cr = rows;
+				cx = curoff - off;
+			}
+			rows++;
+			off = end;
+		} while (off < ends[i]);
+	}
+	if (wrapnext && cx < col-1) {
+		cx++;
+		wrapnext = 0;
+	}
+	s0 = MIN(MAX(s0, rows - row), cr);
+	first = cold ? 0 : MAX(s0 - (int)histsize, 0);
+
+	/* the lines laid out here are packed again */
+	if (cold) {
+		thisttrunc(m);
+		term.rfseq = term.rfnext = term.coldseq;
+	}
+	term.histn = term.rfn = 0;
+	term.lbufseq = 0;
+
+	ring = xmalloc(2 * (term.hot + row) * sizeof(Line));
+	for (i = 0; i < term.hot; i++)
+		ring[i] = NULL;
+	tmp = xmalloc(col * sizeof(Glyph));
+	for (i = 0, j = 0, off = 0; i < nends; i++) {
+		do {
+			end = tlinebreak(term.lbuf, ends[i], off, col);
+			if (j >= first && j < s0 + row) {
+				k = s0 - j;
+				if (k <= term.hot)
+					l = ring[term.hot - k] =
+						xmalloc((col + 1) * sizeof(Glyph));
+				else
+					l = tmp;
+				tlinefill(l, col, term.lbuf + off, end - off,
+				          end < ends[i]);
+				if (k > 0 && cold)
+					thistpack(l, col);
+				else if (k > 0)
+					term.histn++;
+			}
+			j++;
+			off = end;
+		} while (off < ends[i]);
+	}
+	for (y = rows - s0; y < row; y++) {
+		ring[term.hot + y] = xmalloc((col + 1) * sizeof(Glyph));
+		tlinefill(ring[term.hot + y], col, term.lbuf, 0, 0);
+	}
+	memcpy(ring + term.hot + row, ring, (term.hot + row) * sizeof(Line));
+
+	for (i = 0; i < term.hot + term.row; i++)
+		free(term.ring[i]);
+	free(term.ring);
+	term.ring = ring;
+	term.base = term.hot;
+	free(tmp);
+	free(ends);
+	free(term.lbuf);
+	term.lbuf = NULL;
+	term.lbuflen = term.lbufcap = 0;
+
+	c->x = cx;
+	c->y = cr - s0;
+	if (wrapnext)
+		c->state |= CURSOR_WRAPNEXT;
+	else
+		c->state &= ~CURSOR_WRAPNEXT;
+}
+
 void
 tresize(int col, int row)
 {
 	int i, j;
 	int minrow = MIN(row, term.row);
 	int mincol = MIN(col, term.col);
+	int slide = MAX(term.c.y - row + 1, 0);
+	int reflow = term.ring && (col != term.col || row < term.row);
 	int *bp;
+	Line *ring;
 	TCursor c;
 
 	if (col < 1 || row < 1) {
@@ -2615,50 +4807,78 @@ tresize(int col, int row)
 		return;
 	}
 
-	/*
-	 * slide screen to keep cursor where we expect it -
-	 * tscrollup would work here, but we can optimize to
-	 * memmove because we're freeing the earlier lines
-	 */
-	for (i = 0; i <= term.c.y - row; i++) {
-		free(term.line[i]);
-		free(term.alt[i]);
+	if (reflow) {
+		selclear();
+		treflow(col, row);
+	} else {
+		/*
+		 * Build the ring for the new height: the history keeps its
+		 * place in front of the screen, which only grows here.
+		 */
+		ring = xmalloc(2 * (term.hot + row) * sizeof(Line));
+		for (i = 1; i <= term.hot; i++) {
+			ring[term.hot - i] = term.ring ?
+				term.ring[term.base + term.row + term.hot - i] : NULL;
+		}
+		for (i = 0; i < term.row; i++)
+			ring[term.hot + i] = term.ring[term.base + i];
+		free(term.ring);
+		term.ring = ring;
+		term.base = term.hot;
 	}
-	/* ensure that both src and dst are not NULL */
-	if (i > 0) {
-		memmove(term.line, term.line + i, row * sizeof(Line));
-		memmove(term.alt, term.alt + i, row * sizeof(Line));
+	for (i = 0; i < term.row; i++) {
+		if (i < slide || i >= slide + row)
+			free(term.alt[i]);
 	}
-	for (i += row; i < term.row; i++) {
-		free(term.line[i]);
-		free(term.alt[i]);
+	/* ensure that both src and dst are not NULL */
+	if (slide > 0)
+		memmove(term.alt, term.alt + slide, row * sizeof(Line));
+
+	/* decompressed lines are cut to the width */
+	for (i = 0; term.cache && i < term.row + 1; i++)
+		free(term.cache[i]);
+	term.cache = xrealloc(term.cache, (row + 1) * sizeof(Line));
+	term.cacheseq = xrealloc(term.cacheseq, (row + 1) * sizeof(ulong));
+	for (i = 0; i < row + 1; i++) {
+		term.cache[i] = xmalloc(col * sizeof(Glyph));
+		memset(term.cache[i], 0, col * sizeof(Glyph));
+		term.cacheseq[i] = 0;
 	}
 
 	/* resize to new height */
-	term.line = xrealloc(term.line, row * sizeof(Line));
 	term.alt  = xrealloc(term.alt,  row * sizeof(Line));
 	term.dirty = xrealloc(term.dirty, row * sizeof(*term.dirty));
+	sel.rows = xrealloc(sel.rows, row * sizeof(*sel.rows));
 	term.tabs = xrealloc(term.tabs, col * sizeof(*term.tabs));
 
-	for (i = 0; i < HISTSIZE; i++) {
-		term.hist[i] = xrealloc(term.hist[i], col * sizeof(Glyph));
-		for (j = mincol; j < col; j++) {
-			term.hist[i][j] = term.c.attr;
-			term.hist[i][j].u = ' ';
-		}
-	}
-
 	/* resize each row to new width, zero-pad if needed */
-	for (i = 0; i < minrow; i++) {
-		term.line[i] = xrealloc(term.line[i], col * sizeof(Glyph));
-		term.alt[i]  = xrealloc(term.alt[i],  col * sizeof(Glyph));
-	}
-
+	for (i = 0; i < minrow; i++)
+		term.alt[i] = xrealloc(term.alt[i], (col + 1) * sizeof(Glyph));
 	/* allocate any new rows */
-	for (/* i = minrow */; i < row; i++) {
-		term.line[i] = xmalloc(col * sizeof(Glyph));
-		term.alt[i] = xmalloc(col * sizeof(Glyph));
+	for (/* i = minrow */; i < row; i++)
+		term.alt[i] = xmalloc((col + 1) * sizeof(Glyph));
+
+	if (!reflow) {
+		ring = term.ring;
+		for (i = 0; i < term.hot; i++) {
+			if (!ring[i])
+				continue;
+			ring[i] = xrealloc(ring[i], (col + 1) * sizeof(Glyph));
+			for (j = mincol; j < col; j++) {
+				ring[i][j] = term.c.attr;
+				ring[i][j].u = ' ';
+			}
+		}
+		for (i = 0; i < minrow; i++) {
+			ring[term.hot + i] = xrealloc(ring[term.hot + i],
+			                              (col + 1) * sizeof(Glyph));
+		}
+		for (/* i = minrow */; i < row; i++)
+			ring[term.hot + i] = xmalloc((col + 1) * sizeof(Glyph));
+		memcpy(ring + term.hot + row, ring,
+		       (term.hot + row) * sizeof(Line));
 	}
+	term.line = IS_SET(MODE_ALTSCREEN) ? term.alt : &term.ring[term.base];
 	if (col > term.col) {
 		bp = term.tabs + term.col;
 
@@ -2671,23 +4891,42 @@ tresize(int col, int row)
 	/* update terminal size */
 	term.col = col;
 	term.row = row;
+	selrows();
 	/* reset scrolling region */
 	tsetscroll(0, row-1);
-	/* make use of the LIMIT in tmoveto */
-	tmoveto(term.c.x, term.c.y);
+	/* make use of the LIMIT in tmoveto, the reflowed cursor is in */
+	if (!reflow || IS_SET(MODE_ALTSCREEN))
+		tmoveto(term.c.x, term.c.y);
+	if (reflow) {
+		while (term.histn < term.scr && thistreflow())
+			;
+		term.scr = MIN(term.scr, term.histn);
+		searchreset();
+	}
+	/* the blinking cells of both screens, as they are now */
+	for (i = 0; i < row; i++) {
+		TBLINKS(term.alt[i]) = tblinkcount(term.alt[i]);
+		TBLINKS(term.ring[term.base + i]) =
+			tblinkcount(term.ring[term.base + i]);
+	}
+
 	/* Clearing both screens (it makes dirty all lines) */
 	c = term.c;
 	for (i = 0; i < 2; i++) {
-		if (mincol < col && 0 < minrow) {
-			tclearregion(mincol, 0, col - 1, minrow - 1);
-		}
-		if (0 < col && minrow < row) {
-			tclearregion(0, minrow, col - 1, row - 1);
+		/* a reflowed main screen is filled already */
+		if (!reflow || IS_SET(MODE_ALTSCREEN)) {
+			if (mincol < col && 0 < minrow) {
+				tclearregion(mincol, 0, col - 1, minrow - 1);
+			}
+			if (0 < col && minrow < row) {
+				tclearregion(0, minrow, col - 1, row - 1);
+			}
 		}
 		tswapscreen();
 		tcursor(CURSOR_LOAD);
 	}
 	term.c = c;
+	tfulldirt();
 }
 
 void
@@ -2696,50 +4935,160 @@ resettitle(void)
 	xsettitle(NULL);
 }
 
+/*
+ * The terminal is shared by the thread parsing the tty and the one
+ * drawing it. Whoever waits for it goes next: the lock is taken under
+ * handoff, which a thread waiting for termlock holds, so that the parser
+ * thread can't take it back before the other had its turn.
+ */
+void
+tlock(void)
+{
+	pthread_mutex_lock(&handoff);
+	pthread_mutex_lock(&termlock);
+	pthread_mutex_unlock(&handoff);
+}
+
 void
-drawregion(int x1, int y1, int x2, int y2)
+tunlock(void)
 {
-	int y;
+	pthread_mutex_unlock(&termlock);
+}
 
-	for (y = y1; y < y2; y++) {
-		if (!term.dirty[y])
+/* copy what is dirty to the snapshot, with the terminal locked */
+void
+tsnapshot(void)
+{
+	int y, x, a, b, i, n;
+	Span s;
+	Line l;
+
+	if (snap.row != term.row || snap.col != term.col) {
+		for (y = 0; y < snap.row; y++)
+			free(snap.line[y]);
+		snap.line = xrealloc(snap.line, term.row * sizeof(Line));
+		snap.dirty = xrealloc(snap.dirty, term.row * sizeof(Span));
+		for (y = 0; y < term.row; y++) {
+			snap.line[y] = xmalloc(term.col * sizeof(Glyph));
+			snap.dirty[y] = (Span){ 0, 0 };
+		}
+		snap.row = term.row;
+		snap.col = term.col;
+		tfulldirt();
+	}
+
+	/* the query is drawn over the last row */
+	if (srch.active)
+		term.dirty[term.row-1] = (Span){ 0, term.col };
+
+	for (y = 0; y < term.row; y++) {
+		a = term.dirty[y].x1;
+		b = term.dirty[y].x2;
+		term.dirty[y] = (Span){ 0, 0 };
+		if (a >= b)
 			continue;
 
-		term.dirty[y] = 0;
-		xdrawline(TLINE(y), x1, y, x2);
+		/* never draw half of a wide char */
+		l = TLINE(y);
+		n = srch.active && y < term.row-1 ? searchrow(l) : 0;
+		for (i = 0; i < n; i++) {
+			/* and all of the matches */
+			if (srch.m[i].x1 < b && a < srch.m[i].x2) {
+				a = MIN(a, srch.m[i].x1);
+				b = MAX(b, srch.m[i].x2);
+			}
+		}
+		if (a > 0 && l[a].mode & ATTR_WDUMMY)
+			a--;
+		if (b < term.col && l[b-1].mode & ATTR_WIDE)
+			b++;
+		memcpy(&snap.line[y][a], &l[a], (b - a) * sizeof(Glyph));
+		for (i = 0; i < n; i++) {
+			for (x = MAX(a, srch.m[i].x1); x < MIN(b, srch.m[i].x2); x++)
+				snap.line[y][x].mode ^= ATTR_REVERSE;
+		}
+		s = selspan(y);
+		for (x = MAX(a, s.x1); x < MIN(b, s.x2); x++) {
+			if (!(l[x].mode & ATTR_WDUMMY))
+				snap.line[y][x].mode |= ATTR_SELECTED;
+		}
+		if (snap.dirty[y].x1 < snap.dirty[y].x2) {
+			a = MIN(a, snap.dirty[y].x1);
+			b = MAX(b, snap.dirty[y].x2);
+		}
+		snap.dirty[y] = (Span){ a, b };
+	}
+	if (srch.active)
+		searchprompt(snap.line[term.row-1]);
+
+	snap.cx = term.c.x;
+	snap.cy = term.c.y;
+	if (term.line[snap.cy][snap.cx].mode & ATTR_WDUMMY)
+		snap.cx--;
+	snap.cg = term.line[snap.cy][snap.cx];
+	if (selected(snap.cx, snap.cy))
+		snap.cg.mode |= ATTR_SELECTED;
+	snap.cursor = term.scr == 0 && !srch.active;
+
+	/* last, the history rows unpacked above may have interned pens */
+	if (snap.pencap != term.pencap) {
+		snap.pens = xrealloc(snap.pens, term.pencap * sizeof(Pen));
+		snap.pencap = term.pencap;
+	}
+	if (term.pendirty.x1 < term.pendirty.x2) {
+		memcpy(&snap.pens[term.pendirty.x1], &term.pens[term.pendirty.x1],
+		       (term.pendirty.x2 - term.pendirty.x1) * sizeof(Pen));
+		term.pendirty = (Span){ term.pencap, 0 };
+	}
+}
+
+void
+drawregion(int x1, int y1, int x2, int y2)
+{
+	int y, a, b;
+
+	for (y = y1; y < y2; y++) {
+		a = MAX(snap.dirty[y].x1, x1);
+		b = MIN(snap.dirty[y].x2, x2);
+		snap.dirty[y] = (Span){ 0, 0 };
+		if (a < b)
+			xdrawline(snap.line[y], a, y, b);
 	}
 }
 
 void
 draw(void)
 {
-	int cx = term.c.x, ocx = term.ocx, ocy = term.ocy;
+	int ocx = snap.ocx, ocy = snap.ocy;
 
+	tlock();
+	tsnapshot();
+	tunlock();
 	if (!xstartdraw())
 		return;
 
 	/* adjust cursor position */
-	LIMIT(term.ocx, 0, term.col-1);
-	LIMIT(term.ocy, 0, term.row-1);
-	if (term.line[term.ocy][term.ocx].mode & ATTR_WDUMMY)
-		term.ocx--;
-	if (term.line[term.c.y][cx].mode & ATTR_WDUMMY)
-		cx--;
-
-	drawregion(0, 0, term.col, term.row);
-	if (term.scr == 0)
-		xdrawcursor(cx, term.c.y, term.line[term.c.y][cx],
-				term.ocx, term.ocy, term.line[term.ocy][term.ocx]);
-	term.ocx = cx;
-	term.ocy = term.c.y;
+	LIMIT(snap.ocx, 0, snap.col-1);
+	LIMIT(snap.ocy, 0, snap.row-1);
+	if (snap.line[snap.ocy][snap.ocx].mode & ATTR_WDUMMY)
+		snap.ocx--;
+
+	drawregion(0, 0, snap.col, snap.row);
+	if (snap.cursor)
+		xdrawcursor(snap.cx, snap.cy, snap.cg, snap.ocx, snap.ocy,
+				snap.line[snap.ocy][snap.ocx]);
+	snap.ocx = snap.cx;
+	snap.ocy = snap.cy;
 	xfinishdraw();
-	if (ocx != term.ocx || ocy != term.ocy)
-		xximspot(term.ocx, term.ocy);
+	if (ocx != snap.ocx || ocy != snap.ocy)
+		xximspot(snap.ocx, snap.ocy);
 }
 
 void
 redraw(void)
 {
+	tlock();
 	tfulldirt();
+	tunlock();
 	draw();
 }
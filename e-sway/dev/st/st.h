@@ -11,8 +11,7 @@
 #define DIVCEIL(n, d)		(((n) + ((d) - 1)) / (d))
 #define DEFAULT(a, b)		(a) = (a) ? (a) : (b)
 #define LIMIT(x, a, b)		(x) = (x) < (a) ? (a) : (x) > (b) ? (b) : (x)
-#define ATTRCMP(a, b)		((a).mode != (b).mode || (a).fg != (b).fg || \
-				(a).bg != (b).bg)
+#define ATTRCMP(a, b)		((a).mode != (b).mode || (a).pen != (b).pen)
 #define TIMEDIFF(t1, t2)	((t1.tv_sec-t2.tv_sec)*1000 + \
 				(t1.tv_nsec-t2.tv_nsec)/1E6)
 #define MODBIT(x, set, bit)	((set) ? ((x) |= (bit)) : ((x) &= ~(bit)))
@@ -33,6 +32,8 @@ enum glyph_attribute {
 	ATTR_WRAP       = 1 << 8,
 	ATTR_WIDE       = 1 << 9,
 	ATTR_WDUMMY     = 1 << 10,
+	ATTR_WRAPPAD    = 1 << 11,
+	ATTR_SELECTED   = 1 << 12, /* only in the cells drawn */
 	ATTR_BOLD_FAINT = ATTR_BOLD | ATTR_FAINT,
 };
 
@@ -59,12 +60,16 @@ typedef unsigned short ushort;
 
 typedef uint_least32_t Rune;
 
+typedef struct {
+	uint32_t fg;      /* foreground  */
+	uint32_t bg;      /* background  */
+} Pen;
+
 #define Glyph Glyph_
 typedef struct {
 	Rune u;           /* character code */
 	ushort mode;      /* attribute flags */
-	uint32_t fg;      /* foreground  */
-	uint32_t bg;      /* background  */
+	ushort pen;       /* index of the colors in the pen table */
 } Glyph;
 
 typedef Glyph *Line;
@@ -85,26 +90,42 @@ void kscrolldown(const Arg *);
 void kscrollup(const Arg *);
 void printscreen(const Arg *);
 void printsel(const Arg *);
+void searchstart(const Arg *);
 void sendbreak(const Arg *);
 void toggleprinter(const Arg *);
 
-int tattrset(int);
+int tblinking(void);
+void tfulldirt(void);
+ushort tinternpen(uint32_t, uint32_t);
+Pen tpen(ushort);
+void tlock(void);
 void tnew(int, int);
 void tresize(int, int);
-void tsetdirtattr(int);
+void tsetdirtblink(void);
+void tunlock(void);
+int twrite(const char *, int, int);
 void ttyhangup(void);
 int ttynew(const char *, char *, const char *, char **);
 size_t ttyread(void);
+void ttystats(FILE *);
+size_t ttyflush(void);
 void ttyresize(int, int);
 void ttywrite(const char *, size_t, int);
 
 void resettitle(void);
 
+int searching(void);
+void searchput(const char *, int);
+void searchdel(void);
+void searchnext(int);
+void searchend(int);
+
 void selclear(void);
 void selinit(void);
 void selstart(int, int, int);
 void selextend(int, int, int, int);
 int selected(int, int);
+const char *selread(int *, size_t *);
 char *getsel(void);
 
 size_t utf8encode(Rune, char *);
@@ -121,8 +142,12 @@ extern char *vtiden;
 extern wchar_t *worddelimiters;
 extern int allowaltscreen;
 extern int allowwindowops;
+extern unsigned int osc52max;
 extern char *termname;
 extern unsigned int tabspaces;
+extern unsigned int histsize;
+extern unsigned int ttyreadmax;
+extern double ttyreadtime;
 extern unsigned int defaultfg;
 extern unsigned int defaultbg;
 extern unsigned int defaultcs;
@@ -1,10 +1,15 @@
 /* See LICENSE for license details. */
 #include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <limits.h>
 #include <locale.h>
+#include <pthread.h>
 #include <signal.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 #include <libgen.h>
@@ -67,6 +72,9 @@ static void ttysend(const Arg *);
 #define XEMBED_FOCUS_IN  4
 #define XEMBED_FOCUS_OUT 5
 
+/* selection transfers in chunks at once */
+#define INCR_MAX 8
+
 /* macros */
 #define IS_SET(flag)		((win.mode & (flag)) != 0)
 #define TRUERED(x)		(((x) & 0xff0000) >> 8)
@@ -93,6 +101,7 @@ typedef struct {
 	Colormap cmap;
 	Window win;
 	Drawable buf;
+	Region damage; /* parts of buf not yet copied to the window */
 	GlyphFontSpec *specbuf; /* font spec buffer used for rendering */
 	Atom xembed, wmdeletewin, netwmname, netwmiconname, netwmpid;
 	struct {
@@ -110,11 +119,22 @@ typedef struct {
 	int gm; /* geometry mask */
 } XWindow;
 
+/* A selection sent to a requestor in chunks, see ICCCM 2.7.2 */
+typedef struct {
+	Window win;
+	Atom property, target;
+	const char *data;
+	size_t len, off;
+	struct timespec last;
+} Incr;
+
 typedef struct {
-	Atom xtarget;
+	Atom xtarget, incratom;
 	char *primary, *clipboard;
 	struct timespec tclick1;
 	struct timespec tclick2;
+	size_t chunk; /* largest property written at once */
+	Incr incr[INCR_MAX];
 } XSelection;
 
 /* Font structure */
@@ -138,14 +158,44 @@ typedef struct {
 	Color *col;
 	size_t collen;
 	Font font, bfont, ifont, ibfont;
+	FcPattern *pattern; /* of the fonts, for the variants to come */
 	GC gc;
 } DC;
 
+/*
+ * The cells of a frame are batched by color and drawn in xflushbatch(),
+ * with a few requests for each color: the backgrounds, then the glyphs,
+ * kept to the cells drawn, then the lines over them. Xft uploads each
+ * glyph to the server once, the frame only names them.
+ */
+typedef struct {
+	XftColor col;
+	XRectangle *bg, *lines;
+	XftGlyphFontSpec *specs;
+	int nbg, bgcap, nlines, linecap, nspecs, speccap;
+} Batch;
+
+#define BATCHGLYPHS	8192
+
+#define HISTBUCKETS	24
+
+typedef struct {
+	const char *name;
+	ulong n;
+	double sum, max;              /* ms */
+	ulong bucket[HISTBUCKETS];    /* under 1, 2, 4, ... us */
+} Hist;
+
 static inline ushort sixd_to_16bit(int);
 static int xmakeglyphfontspecs(XftGlyphFontSpec *, const Glyph *, int, int, int);
-static void xdrawglyphfontspecs(const XftGlyphFontSpec *, Glyph, int, int, int);
-static void xdrawglyph(Glyph, int, int);
+static void xdrawglyphfontspecs(const XftGlyphFontSpec *, Glyph, Pen, int, int, int);
+static void xdrawglyph(Glyph, Pen, int, int);
 static void xclear(int, int, int, int);
+static void xdamage(int, int, int, int);
+static inline uint32_t colorhash(const XRenderColor *);
+static Batch *xbatch(const Color *);
+static void xbatchrect(XRectangle **, int *, int *, int, int, int, int);
+static void xflushbatch(void);
 static int xgeommasktogravity(int);
 static int ximopen(Display *);
 static void ximinstantiate(Display *, XPointer, XPointer);
@@ -160,6 +210,20 @@ static int xloadfont(Font *, FcPattern *);
 static void xloadfonts(const char *, double);
 static void xunloadfont(Font *);
 static void xunloadfonts(void);
+static void xreopenfonts(void);
+static Font *xfontvariant(int);
+static uint64_t fontstamp(void);
+static void fontcacheload(void);
+static char *fontcacheget(const char *);
+static void fontcacheput(const char *, const char *);
+static int xdgpath(char *, size_t, const char *, const char *, const char *);
+static void timephase(const char *);
+static void fontrequest(Font *, int, Rune);
+static void *fontworker(void *);
+static int fontready(void);
+static void fontprewarm(void);
+static FcFontSet *fontsortset(FcPattern *);
+static void fontsort(void);
 static void xsetenv(void);
 static void xseturgency(int);
 static int evcol(XEvent *);
@@ -182,13 +246,30 @@ static void selnotify(XEvent *);
 static void selclear_(XEvent *);
 static void selrequest(XEvent *);
 static void setsel(char *, Time);
+static void selfree(char *);
+static Incr *incrstart(XSelectionRequestEvent *, const char *, size_t);
+static void incrsend(Incr *);
+static void incrend(Incr *);
+static int xerror(Display *, XErrorEvent *);
 static void mousesel(XEvent *, int);
 static void mousereport(XEvent *);
 static char *kmap(KeySym, uint);
+static void searchkey(KeySym, const char *, int);
 static int match(uint, uint);
 
+static void histadd(Hist *, double);
+static void statsdump(void);
+static void usr1(int);
+static void ttyreadstat(void);
+static void *parser(void *);
+static void parserstart(int);
 static void run(void);
 static void usage(void);
+static void opts(int, char *[]);
+static int sockpath(struct sockaddr_un *);
+static void serve(void);
+static char **request(int, int *);
+static void client(int, char *[]);
 
 static void (*handler[LASTEvent])(XEvent *) = {
 	[KeyPress] = kpress,
@@ -220,6 +301,7 @@ static void (*handler[LASTEvent])(XEvent *) = {
 static DC dc;
 static XWindow xw;
 static XSelection xsel;
+static int (*xerrorxlib)(Display *, XErrorEvent *);
 static TermWindow win;
 
 /* Font Ring Cache */
@@ -240,6 +322,113 @@ typedef struct {
 static Fontcache *frc = NULL;
 static int frclen = 0;
 static int frccap = 0;
+
+/*
+ * Fonts and glyph indices found for runes, a direct-mapped table hashed
+ * on the rune and the font flags. Entries point into the fonts above,
+ * so it is cleared when they are unloaded.
+ */
+#define GLYPHCACHESIZ 4096
+
+typedef struct {
+	XftFont *font; /* NULL if the entry is unused */
+	FT_UInt glyph;
+	Rune unicodep;
+	int flags;
+} Glyphcache;
+
+static Glyphcache glyphcache[GLYPHCACHESIZ];
+
+/*
+ * Fallback fonts are matched by fontconfig in a worker thread, a
+ * placeholder is drawn meanwhile. Matches come back through a pipe and
+ * are opened in the main thread, as Xlib isn't set up for threads.
+ */
+typedef struct {
+	FcPattern *pattern; /* of the font, then the match */
+	Rune unicodep;
+	int flags;
+	int gen;            /* fonts loaded when it was requested */
+} Fontreq;
+
+static struct {
+	Batch *b;
+	int n, cap;
+	int *hash;          /* index + 1 of the batch of each color, or 0 */
+	int hashcap;
+	XRectangle *clip;   /* the cells drawn */
+	int nclip, clipcap;
+} batch;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	Fontreq *todo, *done;
+	int ntodo, todocap, ndone, donecap;
+	Fontreq *pend;      /* asked for and not opened yet, no pattern */
+	int npend, pendcap;
+	int gen;
+	int fd[2];          /* wakes the main loop, -1 until started */
+	FcFontSet *sets[FRC_ITALICBOLD + 1]; /* the fonts sorted by closeness */
+	int setgen[FRC_ITALICBOLD + 1];
+} fw = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+         .fd = { -1, -1 } };
+
+/*
+ * The fonts matched before, by their patterns, kept in the file of
+ * FONTCACHE under the cache directory. It holds while the files
+ * fontconfig matches with are as they were, which the stamp tells.
+ */
+#define FONTCACHE	"st/fonts"
+#define FONTCACHEMAX	32
+
+static struct {
+	int loaded;
+	uint64_t stamp;
+	char *key[FONTCACHEMAX], *match[FONTCACHEMAX];
+	int n;
+} fcache;
+
+static const struct {
+	const char *env, *def, *name;
+} fontdeps[] = {
+	{ NULL, NULL, "/etc/fonts/fonts.conf" },
+	{ NULL, NULL, "/etc/fonts/conf.d" },
+	{ NULL, NULL, "/var/cache/fontconfig" },
+	{ "XDG_CONFIG_HOME", ".config", "fontconfig" },
+	{ "XDG_CONFIG_HOME", ".config", "fontconfig/fonts.conf" },
+	{ "XDG_CACHE_HOME", ".cache", "fontconfig" },
+};
+
+/* when st started and the last phase of its start ended */
+static struct timespec tstart, tphase;
+
+/*
+ * With parsethread, the tty is read and parsed in a thread of its own,
+ * under tlock(). The main thread handles the events and draws from the
+ * snapshot draw() takes. Xlib is then set up for threads, and what the
+ * parser changes of what is drawn is changed under drawlock, which is
+ * held while drawing.
+ */
+static struct {
+	int ttyfd;
+	int fd[2];          /* wakes the main loop, -1 until started */
+	int woken;          /* a byte is in fd */
+} pt = { .fd = { -1, -1 } };
+static pthread_mutex_t drawlock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Latency histograms, written on SIGUSR1 to $ST_STATS or stderr. The
+ * parse times and the pauses in the output are taken under tlock().
+ */
+static struct {
+	Hist key, parse, draw;
+	struct timespec keyt;         /* a key was pressed */
+	int keyed;                    /* 1 since keyt, 2 once output came */
+	struct timespec lastin;       /* end of the last tty read */
+	double gap;                   /* average pause in the output, ms */
+	volatile sig_atomic_t dump;
+} stats = { { "key to draw" }, { "parse" }, { "draw" } };
 static char *usedfont = NULL;
 static double usedfontsize = 0;
 static double defaultfontsize = 0;
@@ -252,6 +441,7 @@ static char *opt_io    = NULL;
 static char *opt_line  = NULL;
 static char *opt_name  = NULL;
 static char *opt_title = NULL;
+static int opt_daemon = 0;
 
 static uint buttons; /* bit field of pressed buttons */
 static int cursorblinks = 0;
@@ -260,12 +450,13 @@ void
 clipcopy(const Arg *dummy)
 {
 	Atom clipboard;
+	char *old = xsel.clipboard;
 
-	free(xsel.clipboard);
-	xsel.clipboard = NULL;
+	/* both selections may share the text */
+	xsel.clipboard = xsel.primary;
+	selfree(old);
 
 	if (xsel.primary != NULL) {
-		xsel.clipboard = xstrdup(xsel.primary);
 		clipboard = XInternAtom(xw.dpy, "CLIPBOARD", 0);
 		XSetSelectionOwner(xw.dpy, clipboard, xw.win, CurrentTime);
 	}
@@ -510,9 +701,19 @@ propnotify(XEvent *e)
 {
 	XPropertyEvent *xpev;
 	Atom clipboard = XInternAtom(xw.dpy, "CLIPBOARD", 0);
+	int i;
 
 	xpev = &e->xproperty;
-	if (xpev->state == PropertyNewValue &&
+	if (xpev->state == PropertyDelete) {
+		/* the requestor of a transfer wants the next chunk */
+		for (i = 0; i < INCR_MAX; i++) {
+			if (xsel.incr[i].win == xpev->window &&
+			    xsel.incr[i].property == xpev->atom) {
+				incrsend(&xsel.incr[i]);
+				break;
+			}
+		}
+	} else if (xpev->state == PropertyNewValue &&
 			(xpev->atom == XA_PRIMARY ||
 			 xpev->atom == clipboard)) {
 		selnotify(e);
@@ -625,6 +826,8 @@ selrequest(XEvent *e)
 	XSelectionEvent xev;
 	Atom xa_targets, string, clipboard;
 	char *seltext;
+	size_t len;
+	long incrlen;
 
 	xsre = (XSelectionRequestEvent *) e;
 	xev.type = SelectionNotify;
@@ -662,11 +865,21 @@ selrequest(XEvent *e)
 				xsre->selection);
 			return;
 		}
-		if (seltext != NULL) {
+		if (seltext == NULL) {
+			/* reject */
+		} else if ((len = strlen(seltext)) <= xsel.chunk) {
 			XChangeProperty(xsre->display, xsre->requestor,
 					xsre->property, xsre->target,
 					8, PropModeReplace,
-					(uchar *)seltext, strlen(seltext));
+					(uchar *)seltext, len);
+			xev.property = xsre->property;
+		} else if (incrstart(xsre, seltext, len)) {
+			/* too large for one request, announce a transfer */
+			incrlen = len;
+			XChangeProperty(xsre->display, xsre->requestor,
+					xsre->property, xsel.incratom,
+					32, PropModeReplace,
+					(uchar *)&incrlen, 1);
 			xev.property = xsre->property;
 		}
 	}
@@ -676,14 +889,95 @@ selrequest(XEvent *e)
 		fprintf(stderr, "Error sending SelectionNotify event\n");
 }
 
+Incr *
+incrstart(XSelectionRequestEvent *xsre, const char *data, size_t len)
+{
+	struct timespec now;
+	Incr *t = NULL;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < INCR_MAX; i++) {
+		/* give up on requestors which stopped reading */
+		if (xsel.incr[i].win != None &&
+		    TIMEDIFF(now, xsel.incr[i].last) > incrtimeout)
+			incrend(&xsel.incr[i]);
+		if (xsel.incr[i].win == None && !t)
+			t = &xsel.incr[i];
+	}
+	if (!t)
+		return NULL;
+
+	t->win = xsre->requestor;
+	t->property = xsre->property;
+	t->target = xsre->target;
+	t->data = data;
+	t->len = len;
+	t->off = 0;
+	t->last = now;
+	/* st pasting its own selection has these events already */
+	if (t->win != xw.win)
+		XSelectInput(xw.dpy, t->win, PropertyChangeMask);
+	return t;
+}
+
+void
+incrsend(Incr *t)
+{
+	size_t n = MIN(t->len - t->off, xsel.chunk);
+
+	/* the last chunk is empty */
+	XChangeProperty(xw.dpy, t->win, t->property, t->target, 8,
+			PropModeReplace, (uchar *)t->data + t->off, n);
+	t->off += n;
+	clock_gettime(CLOCK_MONOTONIC, &t->last);
+	if (n == 0)
+		incrend(t);
+}
+
+void
+incrend(Incr *t)
+{
+	char *data = (char *)t->data;
+	Window win = t->win;
+	int i;
+
+	t->win = None;
+	t->data = NULL;
+	for (i = 0; i < INCR_MAX; i++) {
+		if (xsel.incr[i].win == win)
+			break;
+	}
+	if (i == INCR_MAX && win != xw.win)
+		XSelectInput(xw.dpy, win, NoEventMask);
+	selfree(data);
+}
+
+/* Free the text of a selection unless it is still in use. */
+void
+selfree(char *str)
+{
+	int i;
+
+	if (str == xsel.primary || str == xsel.clipboard)
+		return;
+	for (i = 0; i < INCR_MAX; i++) {
+		if (xsel.incr[i].data == str)
+			return;
+	}
+	free(str);
+}
+
 void
 setsel(char *str, Time t)
 {
+	char *old = xsel.primary;
+
 	if (!str)
 		return;
 
-	free(xsel.primary);
 	xsel.primary = str;
+	selfree(old);
 
 	XSetSelectionOwner(xw.dpy, XA_PRIMARY, xw.win, t);
 	if (XGetSelectionOwner(xw.dpy, XA_PRIMARY) != xw.win)
@@ -696,6 +990,15 @@ xsetsel(char *str)
 	setsel(str, CurrentTime);
 }
 
+int
+xerror(Display *dpy, XErrorEvent *ee)
+{
+	/* requestors of a selection may go away during its transfer */
+	if (ee->error_code == BadWindow)
+		return 0;
+	return xerrorxlib(dpy, ee);
+}
+
 void
 brelease(XEvent *e)
 {
@@ -760,6 +1063,7 @@ xresize(int col, int row)
 			DefaultDepth(xw.dpy, xw.scr));
 	XftDrawChange(xw.draw, xw.buf);
 	xclear(0, 0, win.w, win.h);
+	xflushbatch();
 
 	/* resize to new width */
 	xw.specbuf = xrealloc(xw.specbuf, col * sizeof(GlyphFontSpec));
@@ -802,6 +1106,7 @@ xloadcols(void)
 	static int loaded;
 	Color *cp;
 
+	pthread_mutex_lock(&drawlock);
 	if (loaded) {
 		for (cp = dc.col; cp < &dc.col[dc.collen]; ++cp)
 			XftColorFree(xw.dpy, xw.vis, xw.cmap, cp);
@@ -818,6 +1123,7 @@ xloadcols(void)
 				die("could not allocate color %d\n", i);
 		}
 	loaded = 1;
+	pthread_mutex_unlock(&drawlock);
 }
 
 int
@@ -844,8 +1150,10 @@ xsetcolorname(int x, const char *name)
 	if (!xloadcolor(x, name, &ncolor))
 		return 1;
 
+	pthread_mutex_lock(&drawlock);
 	XftColorFree(xw.dpy, xw.vis, xw.cmap, &dc.col[x]);
 	dc.col[x] = ncolor;
+	pthread_mutex_unlock(&drawlock);
 
 	return 0;
 }
@@ -856,9 +1164,134 @@ xsetcolorname(int x, const char *name)
 void
 xclear(int x1, int y1, int x2, int y2)
 {
-	XftDrawRect(xw.draw,
-			&dc.col[IS_SET(MODE_REVERSE)? defaultfg : defaultbg],
-			x1, y1, x2-x1, y2-y1);
+	Batch *b = xbatch(&dc.col[IS_SET(MODE_REVERSE)? defaultfg : defaultbg]);
+
+	xbatchrect(&b->bg, &b->nbg, &b->bgcap, x1, y1, x2-x1, y2-y1);
+	xdamage(x1, y1, x2-x1, y2-y1);
+}
+
+/* Where to look for the batch of color c first. */
+uint32_t
+colorhash(const XRenderColor *c)
+{
+	uint64_t k = (uint64_t)c->red << 48 | (uint64_t)c->green << 32 |
+	             (uint64_t)c->blue << 16 | c->alpha;
+
+	return (k * 0x9E3779B97F4A7C15ULL) >> 40;
+}
+
+/* The batch of the color col, added if there is none yet. */
+Batch *
+xbatch(const Color *col)
+{
+	int i, j, m;
+	Batch *b;
+
+	if (2 * batch.n >= batch.hashcap) {
+		batch.hashcap = MAX(2 * batch.hashcap, 64);
+		batch.hash = xrealloc(batch.hash,
+		                      batch.hashcap * sizeof(*batch.hash));
+		memset(batch.hash, 0, batch.hashcap * sizeof(*batch.hash));
+		m = batch.hashcap - 1;
+		for (i = 0; i < batch.n; i++) {
+			for (j = colorhash(&batch.b[i].col.color) & m;
+			     batch.hash[j]; j = (j + 1) & m)
+				;
+			batch.hash[j] = i + 1;
+		}
+	}
+
+	m = batch.hashcap - 1;
+	for (j = colorhash(&col->color) & m; batch.hash[j]; j = (j + 1) & m) {
+		b = &batch.b[batch.hash[j] - 1];
+		if (!memcmp(&b->col.color, &col->color, sizeof(col->color)))
+			return b;
+	}
+
+	if (batch.n == batch.cap) {
+		batch.cap = MAX(2 * batch.cap, 16);
+		batch.b = xrealloc(batch.b, batch.cap * sizeof(*batch.b));
+		memset(batch.b + batch.n, 0,
+		       (batch.cap - batch.n) * sizeof(*batch.b));
+	}
+	b = &batch.b[batch.n];
+	b->col = *col;
+	b->nbg = b->nlines = b->nspecs = 0;
+	batch.hash[j] = ++batch.n;
+
+	return b;
+}
+
+/* Add a rectangle to r, joining it to the last one when they line up. */
+void
+xbatchrect(XRectangle **r, int *n, int *cap, int x, int y, int w, int h)
+{
+	XRectangle *l = *n > 0 ? &(*r)[*n - 1] : NULL;
+
+	if (w <= 0 || h <= 0)
+		return;
+	if (l && l->y == y && l->height == h && l->x + l->width == x) {
+		l->width += w;
+		return;
+	}
+	if (*n == *cap) {
+		*cap = MAX(2 * *cap, 64);
+		*r = xrealloc(*r, *cap * sizeof(**r));
+	}
+	(*r)[(*n)++] = (XRectangle){ x, y, w, h };
+}
+
+/* Draw what was batched. */
+void
+xflushbatch(void)
+{
+	Batch *b;
+	int i, j;
+
+	for (i = 0; i < batch.n; i++) {
+		b = &batch.b[i];
+		if (b->nbg == 0)
+			continue;
+		XSetForeground(xw.dpy, dc.gc, b->col.pixel);
+		XFillRectangles(xw.dpy, xw.buf, dc.gc, b->bg, b->nbg);
+	}
+	if (batch.nclip > 0) {
+		XftDrawSetClipRectangles(xw.draw, 0, 0, batch.clip,
+		                         batch.nclip);
+		for (i = 0; i < batch.n; i++) {
+			b = &batch.b[i];
+			/* in requests short enough without BIG-REQUESTS */
+			for (j = 0; j < b->nspecs; j += BATCHGLYPHS) {
+				XftDrawGlyphFontSpec(xw.draw, &b->col,
+				        b->specs + j,
+				        MIN(b->nspecs - j, BATCHGLYPHS));
+			}
+		}
+		XftDrawSetClip(xw.draw, 0);
+	}
+	for (i = 0; i < batch.n; i++) {
+		b = &batch.b[i];
+		if (b->nlines == 0)
+			continue;
+		XSetForeground(xw.dpy, dc.gc, b->col.pixel);
+		XFillRectangles(xw.dpy, xw.buf, dc.gc, b->lines, b->nlines);
+	}
+
+	batch.n = batch.nclip = 0;
+	if (batch.hash)
+		memset(batch.hash, 0, batch.hashcap * sizeof(*batch.hash));
+}
+
+/*
+ * Absolute coordinates.
+ */
+void
+xdamage(int x, int y, int w, int h)
+{
+	XRectangle r = { x, y, w, h };
+
+	if (w > 0 && h > 0)
+		XUnionRectWithRegion(&r, xw.damage, xw.damage);
 }
 
 void
@@ -919,31 +1352,60 @@ xloadfont(Font *f, FcPattern *pattern)
 	FcPattern *match;
 	FcResult result;
 	XGlyphInfo extents;
+	FcChar8 *key, *s;
+	char *hit;
 	int wantattr, haveattr;
 
 	/*
-	 * Manually configure instead of calling XftMatchFont
-	 * so that we can use the configured pattern for
-	 * "missing glyph" lookups.
+	 * Keep the pattern for "missing glyph" lookups, the worker
+	 * configures it as it does those of the runes.
 	 */
-	configured = FcPatternDuplicate(pattern);
-	if (!configured)
+	f->pattern = FcPatternDuplicate(pattern);
+	if (!f->pattern)
 		return 1;
+	XftDefaultSubstitute(xw.dpy, xw.scr, f->pattern);
+
+	/*
+	 * The font matched for the pattern before, if fontconfig did not
+	 * change since, opens without loading its configuration at all.
+	 */
+	f->match = NULL;
+	key = FcNameUnparse(f->pattern);
+	if (key && (hit = fontcacheget((char *)key)) &&
+	    (match = FcNameParse((FcChar8 *)hit)) &&
+	    !(f->match = XftFontOpenPattern(xw.dpy, match)))
+		FcPatternDestroy(match);
 
-	FcConfigSubstitute(NULL, configured, FcMatchPattern);
-	XftDefaultSubstitute(xw.dpy, xw.scr, configured);
+	if (!f->match) {
+		/*
+		 * Manually configure instead of calling XftMatchFont
+		 * so that the match can be kept.
+		 */
+		if (!FcInit())
+			die("could not init fontconfig.\n");
+		configured = FcPatternDuplicate(pattern);
+		if (!configured)
+			goto err;
 
-	match = FcFontMatch(NULL, configured, &result);
-	if (!match) {
-		FcPatternDestroy(configured);
-		return 1;
-	}
+		FcConfigSubstitute(NULL, configured, FcMatchPattern);
+		XftDefaultSubstitute(xw.dpy, xw.scr, configured);
 
-	if (!(f->match = XftFontOpenPattern(xw.dpy, match))) {
+		match = FcFontMatch(NULL, configured, &result);
 		FcPatternDestroy(configured);
-		FcPatternDestroy(match);
-		return 1;
+		if (!match)
+			goto err;
+
+		s = FcNameUnparse(match);
+		if (!(f->match = XftFontOpenPattern(xw.dpy, match))) {
+			FcPatternDestroy(match);
+			free(s);
+			goto err;
+		}
+		if (key && s)
+			fontcacheput((char *)key, (char *)s);
+		free(s);
 	}
+	free(key);
 
 	if ((XftPatternGetInteger(pattern, "slant", 0, &wantattr) ==
 	    XftResultMatch)) {
@@ -972,7 +1434,6 @@ xloadfont(Font *f, FcPattern *pattern)
 		strlen(ascii_printable), &extents);
 
 	f->set = NULL;
-	f->pattern = configured;
 
 	f->ascent = f->match->ascent;
 	f->descent = f->match->descent;
@@ -983,6 +1444,12 @@ xloadfont(Font *f, FcPattern *pattern)
 	f->width = DIVCEIL(extents.xOff, strlen(ascii_printable));
 
 	return 0;
+
+err:
+	free(key);
+	FcPatternDestroy(f->pattern);
+	f->pattern = NULL;
+	return 1;
 }
 
 void
@@ -1037,31 +1504,53 @@ xloadfonts(const char *fontstr, double fontsize)
 	win.cw = ceilf(dc.font.width * cwscale);
 	win.ch = ceilf(dc.font.height * chscale);
 
-	FcPatternDel(pattern, FC_SLANT);
-	FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ITALIC);
-	if (xloadfont(&dc.ifont, pattern))
-		die("can't open font %s\n", fontstr);
+	/* the italic and bold ones are loaded when first drawn */
+	dc.pattern = pattern;
+}
 
-	FcPatternDel(pattern, FC_WEIGHT);
-	FcPatternAddInteger(pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
-	if (xloadfont(&dc.ibfont, pattern))
-		die("can't open font %s\n", fontstr);
+/* The font of the variant of flags, loaded the first time it is asked for. */
+Font *
+xfontvariant(int flags)
+{
+	Font *f[] = {
+		[FRC_NORMAL] = &dc.font, [FRC_ITALIC] = &dc.ifont,
+		[FRC_BOLD] = &dc.bfont, [FRC_ITALICBOLD] = &dc.ibfont
+	};
+	FcPattern *pattern;
 
-	FcPatternDel(pattern, FC_SLANT);
-	FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ROMAN);
-	if (xloadfont(&dc.bfont, pattern))
-		die("can't open font %s\n", fontstr);
+	if (f[flags]->match)
+		return f[flags];
 
+	pattern = FcPatternDuplicate(dc.pattern);
+	if (flags == FRC_ITALIC || flags == FRC_ITALICBOLD) {
+		FcPatternDel(pattern, FC_SLANT);
+		FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ITALIC);
+	}
+	if (flags == FRC_BOLD || flags == FRC_ITALICBOLD) {
+		FcPatternDel(pattern, FC_WEIGHT);
+		FcPatternAddInteger(pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
+	}
+	if (flags == FRC_BOLD) {
+		FcPatternDel(pattern, FC_SLANT);
+		FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ROMAN);
+	}
+	if (xloadfont(f[flags], pattern))
+		die("can't open font %s\n", usedfont);
 	FcPatternDestroy(pattern);
+
+	return f[flags];
 }
 
 void
 xunloadfont(Font *f)
 {
+	if (!f->match)
+		return;
 	XftFontClose(xw.dpy, f->match);
 	FcPatternDestroy(f->pattern);
 	if (f->set)
 		FcFontSetDestroy(f->set);
+	memset(f, 0, sizeof(*f));
 }
 
 void
@@ -1070,11 +1559,382 @@ xunloadfonts(void)
 	/* Free the loaded fonts in the font cache.  */
 	while (frclen > 0)
 		XftFontClose(xw.dpy, frc[--frclen].font);
+	memset(glyphcache, 0, sizeof(glyphcache));
+
+	/* matches still on their way are for these fonts */
+	fw.npend = 0;
+	fw.gen++;
 
 	xunloadfont(&dc.font);
 	xunloadfont(&dc.bfont);
 	xunloadfont(&dc.ifont);
 	xunloadfont(&dc.ibfont);
+	FcPatternDestroy(dc.pattern);
+}
+
+/*
+ * Open the fonts the server matched and measured on the display of this
+ * window. The server's own are left alone, they are on its connection.
+ */
+void
+xreopenfonts(void)
+{
+	Font *f[] = { &dc.font, &dc.bfont, &dc.ifont, &dc.ibfont };
+	int i;
+
+	for (i = 0; i < LEN(f); i++) {
+		if (!f[i]->match)
+			continue;
+		f[i]->match = XftFontOpenPattern(xw.dpy,
+				FcPatternDuplicate(f[i]->match->pattern));
+		if (!f[i]->match)
+			die("can't open font %s\n", usedfont);
+	}
+}
+
+/*
+ * Put env/name in buf, or $HOME/def/name if env is not set, or just name
+ * if there is no env.
+ */
+int
+xdgpath(char *buf, size_t n, const char *env, const char *def,
+        const char *name)
+{
+	const char *dir;
+	int r;
+
+	if (!env)
+		r = snprintf(buf, n, "%s", name);
+	else if ((dir = getenv(env)) && dir[0])
+		r = snprintf(buf, n, "%s/%s", dir, name);
+	else if ((dir = getenv("HOME")))
+		r = snprintf(buf, n, "%s/%s/%s", dir, def, name);
+	else
+		return -1;
+
+	return r < n ? 0 : -1;
+}
+
+/* A hash of the times and sizes of the files of fontdeps[]. */
+uint64_t
+fontstamp(void)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int i;
+
+	for (i = 0; i < LEN(fontdeps); i++) {
+		if (!xdgpath(path, sizeof(path), fontdeps[i].env,
+		             fontdeps[i].def, fontdeps[i].name) &&
+		    !stat(path, &st)) {
+			h = (h ^ (uint64_t)st.st_mtime) * 0x100000001b3ULL;
+			h = (h ^ (uint64_t)st.st_size) * 0x100000001b3ULL;
+		} else {
+			h *= 0x100000001b3ULL;
+		}
+	}
+
+	return h;
+}
+
+/*
+ * Read the cache: a line with its stamp, then a line for each font with
+ * its pattern and its match, separated by a tab.
+ */
+void
+fontcacheload(void)
+{
+	char path[PATH_MAX], *buf, *p, *nl, *tab;
+	unsigned long long stamp;
+	struct stat st;
+	ssize_t r;
+	size_t off;
+	int fd;
+
+	fcache.loaded = 1;
+	fcache.stamp = fontstamp();
+	if (xdgpath(path, sizeof(path), "XDG_CACHE_HOME", ".cache",
+	            FONTCACHE) < 0 || (fd = open(path, O_RDONLY)) < 0)
+		return;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return;
+	}
+	buf = xmalloc(st.st_size + 1);
+	for (off = 0; off < st.st_size; off += r) {
+		if ((r = read(fd, buf + off, st.st_size - off)) <= 0)
+			break;
+	}
+	close(fd);
+	buf[off] = '\0';
+
+	p = NULL;
+	if (sscanf(buf, "st fonts %llx\n", &stamp) == 1 &&
+	    stamp == fcache.stamp)
+		p = strchr(buf, '\n');
+	while (p && fcache.n < FONTCACHEMAX) {
+		if ((nl = strchr(++p, '\n')))
+			*nl = '\0';
+		if ((tab = strchr(p, '\t'))) {
+			*tab = '\0';
+			fcache.key[fcache.n] = xstrdup(p);
+			fcache.match[fcache.n++] = xstrdup(tab + 1);
+		}
+		p = nl;
+	}
+	free(buf);
+}
+
+/* The match kept for the pattern key, NULL if none is. */
+char *
+fontcacheget(const char *key)
+{
+	int i;
+
+	if (!fcache.loaded)
+		fontcacheload();
+	for (i = 0; i < fcache.n; i++) {
+		if (!strcmp(fcache.key[i], key))
+			return fcache.match[i];
+	}
+
+	return NULL;
+}
+
+/* Keep the match of the pattern key, in place of the oldest if full. */
+void
+fontcacheput(const char *key, const char *match)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 16], *p;
+	FILE *fp;
+	int i;
+
+	if (fcache.n == FONTCACHEMAX) {
+		free(fcache.key[0]);
+		free(fcache.match[0]);
+		memmove(fcache.key, fcache.key + 1,
+		        --fcache.n * sizeof(*fcache.key));
+		memmove(fcache.match, fcache.match + 1,
+		        fcache.n * sizeof(*fcache.match));
+	}
+	fcache.key[fcache.n] = xstrdup(key);
+	fcache.match[fcache.n++] = xstrdup(match);
+
+	/* the file is replaced whole, as other windows read it */
+	if (xdgpath(path, sizeof(path), "XDG_CACHE_HOME", ".cache",
+	            FONTCACHE) < 0)
+		return;
+	for (p = path + 1; (p = strchr(p, '/')); *p++ = '/') {
+		*p = '\0';
+		mkdir(path, 0700);
+	}
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	if (!(fp = fopen(tmp, "w")))
+		return;
+	fprintf(fp, "st fonts %llx\n", (unsigned long long)fcache.stamp);
+	for (i = 0; i < fcache.n; i++)
+		fprintf(fp, "%s\t%s\n", fcache.key[i], fcache.match[i]);
+	if (fclose(fp) || rename(tmp, path) < 0)
+		unlink(tmp);
+}
+
+/* Ask the worker for a fallback font of rune, unless it was asked for. */
+void
+fontrequest(Font *font, int flags, Rune rune)
+{
+	pthread_t thread;
+	Fontreq r;
+	int i;
+
+	for (i = 0; i < fw.npend; i++) {
+		if (fw.pend[i].unicodep == rune && fw.pend[i].flags == flags)
+			return;
+	}
+
+	/*
+	 * Started with the first request, which comes after the shell is
+	 * forked, so the child never sees the worker holding a lock.
+	 */
+	if (fw.fd[0] < 0) {
+		if (pipe(fw.fd) < 0)
+			die("pipe failed: %s\n", strerror(errno));
+		fcntl(fw.fd[0], F_SETFL, O_NONBLOCK);
+		fcntl(fw.fd[1], F_SETFL, O_NONBLOCK);
+		if ((errno = pthread_create(&thread, NULL, fontworker, NULL)))
+			die("pthread_create failed: %s\n", strerror(errno));
+		pthread_detach(thread);
+	}
+
+	r = (Fontreq){ NULL, rune, flags, fw.gen };
+	if (fw.npend == fw.pendcap) {
+		fw.pendcap = MAX(2 * fw.pendcap, 16);
+		fw.pend = xrealloc(fw.pend, fw.pendcap * sizeof(*fw.pend));
+	}
+	fw.pend[fw.npend++] = r;
+
+	r.pattern = FcPatternDuplicate(font->pattern);
+	pthread_mutex_lock(&fw.lock);
+	if (fw.ntodo == fw.todocap) {
+		fw.todocap = MAX(2 * fw.todocap, 16);
+		fw.todo = xrealloc(fw.todo, fw.todocap * sizeof(*fw.todo));
+	}
+	fw.todo[fw.ntodo++] = r;
+	pthread_cond_signal(&fw.cond);
+	pthread_mutex_unlock(&fw.lock);
+}
+
+void *
+fontworker(void *unused)
+{
+	FcFontSet *fcsets[] = { NULL };
+	FcPattern *fcpattern;
+	FcCharSet *fccharset;
+	FcResult fcres;
+	Fontreq r;
+
+	for (;;) {
+		pthread_mutex_lock(&fw.lock);
+		while (fw.ntodo == 0)
+			pthread_cond_wait(&fw.cond, &fw.lock);
+		r = fw.todo[0];
+		memmove(fw.todo, fw.todo + 1, --fw.ntodo * sizeof(*fw.todo));
+		pthread_mutex_unlock(&fw.lock);
+
+		/* the fonts sorted by closeness, again after a reload */
+		if (!fw.sets[r.flags] || fw.setgen[r.flags] != r.gen) {
+			if (fw.sets[r.flags])
+				FcFontSetDestroy(fw.sets[r.flags]);
+			fw.sets[r.flags] = fontsortset(r.pattern);
+			fw.setgen[r.flags] = r.gen;
+		}
+		fcsets[0] = fw.sets[r.flags];
+
+		/*
+		 * Nothing was found in the cache. Now use
+		 * some dozen of Fontconfig calls to get the
+		 * font for one single character.
+		 *
+		 * Xft and fontconfig are design failures.
+		 */
+		fcpattern = r.pattern;
+		fccharset = FcCharSetCreate();
+
+		FcCharSetAddChar(fccharset, r.unicodep);
+		FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
+		FcPatternAddBool(fcpattern, FC_SCALABLE, 1);
+
+		FcConfigSubstitute(0, fcpattern, FcMatchPattern);
+		FcDefaultSubstitute(fcpattern);
+
+		r.pattern = FcFontSetMatch(0, fcsets, 1, fcpattern, &fcres);
+
+		FcPatternDestroy(fcpattern);
+		FcCharSetDestroy(fccharset);
+
+		pthread_mutex_lock(&fw.lock);
+		if (fw.ndone == fw.donecap) {
+			fw.donecap = MAX(2 * fw.donecap, 16);
+			fw.done = xrealloc(fw.done, fw.donecap * sizeof(*fw.done));
+		}
+		fw.done[fw.ndone++] = r;
+		pthread_mutex_unlock(&fw.lock);
+		write(fw.fd[1], "", 1);
+	}
+
+	return NULL;
+}
+
+/* Open the fonts matched by the worker, return 1 if any. */
+int
+fontready(void)
+{
+	char buf[64];
+	Fontreq r;
+	int i, n = 0;
+
+	while (read(fw.fd[0], buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&fw.lock);
+	while (fw.ndone > 0) {
+		r = fw.done[--fw.ndone];
+		if (r.gen != fw.gen) {
+			if (r.pattern)
+				FcPatternDestroy(r.pattern);
+			continue;
+		}
+		for (i = 0; i < fw.npend; i++) {
+			if (fw.pend[i].unicodep == r.unicodep &&
+			    fw.pend[i].flags == r.flags)
+				break;
+		}
+		fw.pend[i] = fw.pend[--fw.npend];
+		if (!r.pattern)
+			die("FcFontSetMatch failed seeking fallback font\n");
+
+		/* Allocate memory for the new cache entry. */
+		if (frclen >= frccap) {
+			frccap += 16;
+			frc = xrealloc(frc, frccap * sizeof(Fontcache));
+		}
+
+		frc[frclen].font = XftFontOpenPattern(xw.dpy, r.pattern);
+		if (!frc[frclen].font)
+			die("XftFontOpenPattern failed seeking fallback font: %s\n",
+				strerror(errno));
+		frc[frclen].flags = r.flags;
+		frc[frclen].unicodep = r.unicodep;
+		frclen++;
+		n++;
+	}
+	pthread_mutex_unlock(&fw.lock);
+
+	return n > 0;
+}
+
+/* The fonts sorted by closeness to the pattern of a font. */
+FcFontSet *
+fontsortset(FcPattern *pattern)
+{
+	FcPattern *configured;
+	FcFontSet *set;
+	FcResult res;
+
+	configured = FcPatternDuplicate(pattern);
+	FcConfigSubstitute(0, configured, FcMatchPattern);
+	FcDefaultSubstitute(configured);
+	set = FcFontSort(0, configured, 1, 0, &res);
+	FcPatternDestroy(configured);
+
+	return set;
+}
+
+/*
+ * Load the variants and sort the fonts for the fallbacks ahead of the
+ * worker, in the server, so that the windows it forks have them.
+ */
+void
+fontsort(void)
+{
+	int i;
+
+	for (i = FRC_NORMAL; i <= FRC_ITALICBOLD; i++) {
+		fw.sets[i] = fontsortset(xfontvariant(i)->pattern);
+		fw.setgen[i] = fw.gen;
+	}
+}
+
+/* Look for the fallback fonts of prewarm[] the font misses. */
+void
+fontprewarm(void)
+{
+	int i;
+
+	for (i = 0; i < LEN(prewarm); i++) {
+		if (!XftCharIndex(xw.dpy, dc.font.match, prewarm[i]))
+			fontrequest(&dc.font, FRC_NORMAL, prewarm[i]);
+	}
 }
 
 int
@@ -1142,15 +2002,31 @@ xinit(int cols, int rows)
 
 	if (!(xw.dpy = XOpenDisplay(NULL)))
 		die("can't open display\n");
+	xerrorxlib = XSetErrorHandler(xerror);
 	xw.scr = XDefaultScreen(xw.dpy);
 	xw.vis = XDefaultVisual(xw.dpy, xw.scr);
+	timephase("display");
 
 	/* font */
-	if (!FcInit())
-		die("could not init fontconfig.\n");
-
-	usedfont = (opt_font == NULL)? font : opt_font;
-	xloadfonts(usedfont, 0);
+	if (usedfont && !strcmp(usedfont, opt_font ? opt_font : font)) {
+		/* loaded by the server this window is forked from */
+		xreopenfonts();
+	} else {
+		if (usedfont) {
+			/*
+			 * another font than the server's: its variants and
+			 * sorts are on its connection, forget them unclosed
+			 */
+			memset(&dc.bfont, 0, sizeof(dc.bfont));
+			memset(&dc.ifont, 0, sizeof(dc.ifont));
+			memset(&dc.ibfont, 0, sizeof(dc.ibfont));
+			dc.pattern = NULL;
+			fw.gen++;
+		}
+		usedfont = (opt_font == NULL)? font : opt_font;
+		xloadfonts(usedfont, 0);
+	}
+	timephase("fonts");
 
 	/* colors */
 	xw.cmap = XDefaultColormap(xw.dpy, xw.scr);
@@ -1188,6 +2064,7 @@ xinit(int cols, int rows)
 			DefaultDepth(xw.dpy, xw.scr));
 	XSetForeground(xw.dpy, dc.gc, dc.col[defaultbg].pixel);
 	XFillRectangle(xw.dpy, xw.buf, dc.gc, 0, 0, win.w, win.h);
+	xw.damage = XCreateRegion();
 
 	/* font spec buffer */
 	xw.specbuf = xmalloc(cols * sizeof(GlyphFontSpec));
@@ -1234,6 +2111,7 @@ xinit(int cols, int rows)
 	xhints();
 	XMapWindow(xw.dpy, xw.win);
 	XSync(xw.dpy, False);
+	timephase("window");
 
 	clock_gettime(CLOCK_MONOTONIC, &xsel.tclick1);
 	clock_gettime(CLOCK_MONOTONIC, &xsel.tclick2);
@@ -1242,6 +2120,8 @@ xinit(int cols, int rows)
 	xsel.xtarget = XInternAtom(xw.dpy, "UTF8_STRING", 0);
 	if (xsel.xtarget == None)
 		xsel.xtarget = XA_STRING;
+	xsel.incratom = XInternAtom(xw.dpy, "INCR", 0);
+	xsel.chunk = XMaxRequestSize(xw.dpy) * 4 - 64;
 }
 
 int
@@ -1254,10 +2134,7 @@ xmakeglyphfontspecs(XftGlyphFontSpec *specs, const Glyph *glyphs, int len, int x
 	float runewidth = win.cw;
 	Rune rune;
 	FT_UInt glyphidx;
-	FcResult fcres;
-	FcPattern *fcpattern, *fontpattern;
-	FcFontSet *fcsets[] = { NULL };
-	FcCharSet *fccharset;
+	Glyphcache *gc;
 	int i, f, numspecs = 0;
 
 	for (i = 0, xp = winx, yp = winy + font->ascent; i < len; ++i) {
@@ -1272,27 +2149,38 @@ xmakeglyphfontspecs(XftGlyphFontSpec *specs, const Glyph *glyphs, int len, int x
 		/* Determine font for glyph if different from previous glyph. */
 		if (prevmode != mode) {
 			prevmode = mode;
-			font = &dc.font;
 			frcflags = FRC_NORMAL;
 			runewidth = win.cw * ((mode & ATTR_WIDE) ? 2.0f : 1.0f);
-			if ((mode & ATTR_ITALIC) && (mode & ATTR_BOLD)) {
-				font = &dc.ibfont;
+			if ((mode & ATTR_ITALIC) && (mode & ATTR_BOLD))
 				frcflags = FRC_ITALICBOLD;
-			} else if (mode & ATTR_ITALIC) {
-				font = &dc.ifont;
+			else if (mode & ATTR_ITALIC)
 				frcflags = FRC_ITALIC;
-			} else if (mode & ATTR_BOLD) {
-				font = &dc.bfont;
+			else if (mode & ATTR_BOLD)
 				frcflags = FRC_BOLD;
-			}
+			font = xfontvariant(frcflags);
 			yp = winy + font->ascent;
 		}
 
+		/* Lookup the font and index found for it before. */
+		gc = &glyphcache[((rune * 2654435761U) >> 8 ^ frcflags)
+		                 & (GLYPHCACHESIZ - 1)];
+		if (gc->font && gc->unicodep == rune && gc->flags == frcflags) {
+			specs[numspecs].font = gc->font;
+			specs[numspecs].glyph = gc->glyph;
+			specs[numspecs].x = (short)xp;
+			specs[numspecs].y = (short)yp;
+			xp += runewidth;
+			numspecs++;
+			continue;
+		}
+		gc->unicodep = rune;
+		gc->flags = frcflags;
+
 		/* Lookup character index with default font. */
 		glyphidx = XftCharIndex(xw.dpy, font->match, rune);
 		if (glyphidx) {
-			specs[numspecs].font = font->match;
-			specs[numspecs].glyph = glyphidx;
+			specs[numspecs].font = gc->font = font->match;
+			specs[numspecs].glyph = gc->glyph = glyphidx;
 			specs[numspecs].x = (short)xp;
 			specs[numspecs].y = (short)yp;
 			xp += runewidth;
@@ -1313,60 +2201,24 @@ xmakeglyphfontspecs(XftGlyphFontSpec *specs, const Glyph *glyphs, int len, int x
 			}
 		}
 
-		/* Nothing was found. Use fontconfig to find matching font. */
+		/*
+		 * Nothing was found. Have fontconfig find a matching font in
+		 * the background and draw the missing glyph until then.
+		 */
 		if (f >= frclen) {
-			if (!font->set)
-				font->set = FcFontSort(0, font->pattern,
-				                       1, 0, &fcres);
-			fcsets[0] = font->set;
-
-			/*
-			 * Nothing was found in the cache. Now use
-			 * some dozen of Fontconfig calls to get the
-			 * font for one single character.
-			 *
-			 * Xft and fontconfig are design failures.
-			 */
-			fcpattern = FcPatternDuplicate(font->pattern);
-			fccharset = FcCharSetCreate();
-
-			FcCharSetAddChar(fccharset, rune);
-			FcPatternAddCharSet(fcpattern, FC_CHARSET,
-					fccharset);
-			FcPatternAddBool(fcpattern, FC_SCALABLE, 1);
-
-			FcConfigSubstitute(0, fcpattern,
-					FcMatchPattern);
-			FcDefaultSubstitute(fcpattern);
-
-			fontpattern = FcFontSetMatch(0, fcsets, 1,
-					fcpattern, &fcres);
-
-			/* Allocate memory for the new cache entry. */
-			if (frclen >= frccap) {
-				frccap += 16;
-				frc = xrealloc(frc, frccap * sizeof(Fontcache));
-			}
-
-			frc[frclen].font = XftFontOpenPattern(xw.dpy,
-					fontpattern);
-			if (!frc[frclen].font)
-				die("XftFontOpenPattern failed seeking fallback font: %s\n",
-					strerror(errno));
-			frc[frclen].flags = frcflags;
-			frc[frclen].unicodep = rune;
-
-			glyphidx = XftCharIndex(xw.dpy, frc[frclen].font, rune);
-
-			f = frclen;
-			frclen++;
-
-			FcPatternDestroy(fcpattern);
-			FcCharSetDestroy(fccharset);
+			fontrequest(font, frcflags, rune);
+			gc->font = NULL;
+			specs[numspecs].font = font->match;
+			specs[numspecs].glyph = 0;
+			specs[numspecs].x = (short)xp;
+			specs[numspecs].y = (short)yp;
+			xp += runewidth;
+			numspecs++;
+			continue;
 		}
 
-		specs[numspecs].font = frc[f].font;
-		specs[numspecs].glyph = glyphidx;
+		specs[numspecs].font = gc->font = frc[f].font;
+		specs[numspecs].glyph = gc->glyph = glyphidx;
 		specs[numspecs].x = (short)xp;
 		specs[numspecs].y = (short)yp;
 		xp += runewidth;
@@ -1377,49 +2229,50 @@ xmakeglyphfontspecs(XftGlyphFontSpec *specs, const Glyph *glyphs, int len, int x
 }
 
 void
-xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, int len, int x, int y)
+xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, Pen pen,
+		int len, int x, int y)
 {
 	int charlen = len * ((base.mode & ATTR_WIDE) ? 2 : 1);
 	int winx = win.hborderpx + x * win.cw, winy = win.vborderpx + y * win.ch,
 	    width = charlen * win.cw;
 	Color *fg, *bg, *temp, revfg, revbg, truefg, truebg;
 	XRenderColor colfg, colbg;
-	XRectangle r;
+	Batch *b;
 
 	/* Fallback on color display for attributes not supported by the font */
 	if (base.mode & ATTR_ITALIC && base.mode & ATTR_BOLD) {
 		if (dc.ibfont.badslant || dc.ibfont.badweight)
-			base.fg = defaultattr;
+			pen.fg = defaultattr;
 	} else if ((base.mode & ATTR_ITALIC && dc.ifont.badslant) ||
 	    (base.mode & ATTR_BOLD && dc.bfont.badweight)) {
-		base.fg = defaultattr;
+		pen.fg = defaultattr;
 	}
 
-	if (IS_TRUECOL(base.fg)) {
+	if (IS_TRUECOL(pen.fg)) {
 		colfg.alpha = 0xffff;
-		colfg.red = TRUERED(base.fg);
-		colfg.green = TRUEGREEN(base.fg);
-		colfg.blue = TRUEBLUE(base.fg);
+		colfg.red = TRUERED(pen.fg);
+		colfg.green = TRUEGREEN(pen.fg);
+		colfg.blue = TRUEBLUE(pen.fg);
 		XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg, &truefg);
 		fg = &truefg;
 	} else {
-		fg = &dc.col[base.fg];
+		fg = &dc.col[pen.fg];
 	}
 
-	if (IS_TRUECOL(base.bg)) {
+	if (IS_TRUECOL(pen.bg)) {
 		colbg.alpha = 0xffff;
-		colbg.green = TRUEGREEN(base.bg);
-		colbg.red = TRUERED(base.bg);
-		colbg.blue = TRUEBLUE(base.bg);
+		colbg.green = TRUEGREEN(pen.bg);
+		colbg.red = TRUERED(pen.bg);
+		colbg.blue = TRUEBLUE(pen.bg);
 		XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colbg, &truebg);
 		bg = &truebg;
 	} else {
-		bg = &dc.col[base.bg];
+		bg = &dc.col[pen.bg];
 	}
 
 	/* Change basic system colors [0-7] to bright system colors [8-15] */
-	if ((base.mode & ATTR_BOLD_FAINT) == ATTR_BOLD && BETWEEN(base.fg, 0, 7))
-		fg = &dc.col[base.fg + 8];
+	if ((base.mode & ATTR_BOLD_FAINT) == ATTR_BOLD && BETWEEN(pen.fg, 0, 7))
+		fg = &dc.col[pen.fg + 8];
 
 	if (IS_SET(MODE_REVERSE)) {
 		if (fg == &dc.col[defaultfg]) {
@@ -1484,52 +2337,60 @@ xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, int len, int x, i
 		xclear(winx, winy + win.ch, winx + width, win.h);
 
 	/* Clean up the region we want to draw to. */
-	XftDrawRect(xw.draw, bg, winx, winy, width, win.ch);
-
-	/* Set the clip region because Xft is sometimes dirty. */
-	r.x = 0;
-	r.y = 0;
-	r.height = win.ch;
-	r.width = width;
-	XftDrawSetClipRectangles(xw.draw, winx, winy, &r, 1);
-
-	/* Render the glyphs. */
-	XftDrawGlyphFontSpec(xw.draw, fg, specs, len);
+	b = xbatch(bg);
+	xbatchrect(&b->bg, &b->nbg, &b->bgcap, winx, winy, width, win.ch);
+	xdamage(winx, winy, width, win.ch);
+
+	/* The glyphs are clipped to the cells because Xft is sometimes dirty. */
+	xbatchrect(&batch.clip, &batch.nclip, &batch.clipcap,
+	           winx, winy, width, win.ch);
+	if (fg == bg)
+		return;
+	b = xbatch(fg);
+	if (b->nspecs + len > b->speccap) {
+		b->speccap = MAX(2 * b->speccap, b->nspecs + len);
+		b->specs = xrealloc(b->specs, b->speccap * sizeof(*b->specs));
+	}
+	memcpy(b->specs + b->nspecs, specs, len * sizeof(*specs));
+	b->nspecs += len;
 
 	/* Render underline and strikethrough. */
 	if (base.mode & ATTR_UNDERLINE) {
-		XftDrawRect(xw.draw, fg, winx, winy + dc.font.ascent * chscale + 1,
-				width, 1);
+		xbatchrect(&b->lines, &b->nlines, &b->linecap, winx,
+		           winy + dc.font.ascent * chscale + 1, width, 1);
 	}
 
 	if (base.mode & ATTR_STRUCK) {
-		XftDrawRect(xw.draw, fg, winx, winy + 2 * dc.font.ascent * chscale / 3,
-				width, 1);
+		xbatchrect(&b->lines, &b->nlines, &b->linecap, winx,
+		           winy + 2 * dc.font.ascent * chscale / 3, width, 1);
 	}
-
-	/* Reset clip to none. */
-	XftDrawSetClip(xw.draw, 0);
 }
 
 void
-xdrawglyph(Glyph g, int x, int y)
+xdrawglyph(Glyph g, Pen pen, int x, int y)
 {
 	int numspecs;
 	XftGlyphFontSpec spec;
 
 	numspecs = xmakeglyphfontspecs(&spec, &g, 1, x, y);
-	xdrawglyphfontspecs(&spec, g, numspecs, x, y);
+	xdrawglyphfontspecs(&spec, g, pen, numspecs, x, y);
+	xflushbatch();
 }
 
 void
 xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og)
 {
 	Color drawcol;
+	uint32_t fg, bg;
+	int sel = g.mode & ATTR_SELECTED;
+
+	/* the lines under it first */
+	xflushbatch();
 
 	/* remove the old cursor */
-	if (selected(ox, oy))
+	if (og.mode & ATTR_SELECTED)
 		og.mode ^= ATTR_REVERSE;
-	xdrawglyph(og, ox, oy);
+	xdrawglyph(og, tpen(og.pen), ox, oy);
 
 	if (IS_SET(MODE_HIDE))
 		return;
@@ -1541,26 +2402,28 @@ xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og)
 
 	if (IS_SET(MODE_REVERSE)) {
 		g.mode |= ATTR_REVERSE;
-		g.bg = defaultfg;
-		if (selected(cx, cy)) {
+		bg = defaultfg;
+		if (sel) {
 			drawcol = dc.col[defaultcs];
-			g.fg = defaultrcs;
+			fg = defaultrcs;
 		} else {
 			drawcol = dc.col[defaultrcs];
-			g.fg = defaultcs;
+			fg = defaultcs;
 		}
 	} else {
-		if (selected(cx, cy)) {
-			g.fg = defaultfg;
-			g.bg = defaultrcs;
+		if (sel) {
+			fg = defaultfg;
+			bg = defaultrcs;
 		} else {
-			g.fg = defaultbg;
-			g.bg = defaultcs;
+			fg = defaultbg;
+			bg = defaultcs;
 		}
-		drawcol = dc.col[g.bg];
+		drawcol = dc.col[bg];
 	}
 
 	/* draw the new one */
+	xdamage(win.hborderpx + cx * win.cw, win.vborderpx + cy * win.ch,
+	        win.cw, win.ch);
 	if (IS_SET(MODE_FOCUSED)) {
 		switch (win.cursor) {
 		default:
@@ -1570,7 +2433,7 @@ xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og)
 				break;
 			/* FALLTHROUGH */
 		case 2: /* steady block */
-			xdrawglyph(g, cx, cy);
+			xdrawglyph(g, (Pen){ fg, bg }, cx, cy);
 			break;
 		case 3: /* blinking underline */
 			if (IS_SET(MODE_BLINK))
@@ -1599,7 +2462,7 @@ xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og)
 			/* FALLTHROUGH */
 		case 8: /* steady st cursor */
 			g.u = stcursor;
-			xdrawglyph(g, cx, cy);
+			xdrawglyph(g, (Pen){ fg, bg }, cx, cy);
 			break;
 		}
 	} else {
@@ -1662,7 +2525,11 @@ xsettitle(char *p)
 int
 xstartdraw(void)
 {
-	return IS_SET(MODE_VISIBLE);
+	pthread_mutex_lock(&drawlock);
+	if (IS_SET(MODE_VISIBLE))
+		return 1;
+	pthread_mutex_unlock(&drawlock);
+	return 0;
 }
 
 void
@@ -1678,10 +2545,11 @@ xdrawline(Line line, int x1, int y1, int x2)
 		new = line[x];
 		if (new.mode == ATTR_WDUMMY)
 			continue;
-		if (selected(x, y1))
+		if (new.mode & ATTR_SELECTED)
 			new.mode ^= ATTR_REVERSE;
 		if (i > 0 && ATTRCMP(base, new)) {
-			xdrawglyphfontspecs(specs, base, i, ox, y1);
+			xdrawglyphfontspecs(specs, base, tpen(base.pen), i,
+					ox, y1);
 			specs += i;
 			numspecs -= i;
 			i = 0;
@@ -1693,17 +2561,30 @@ xdrawline(Line line, int x1, int y1, int x2)
 		i++;
 	}
 	if (i > 0)
-		xdrawglyphfontspecs(specs, base, i, ox, y1);
+		xdrawglyphfontspecs(specs, base, tpen(base.pen), i, ox, y1);
 }
 
 void
 xfinishdraw(void)
 {
-	XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, 0, 0, win.w,
-			win.h, 0, 0);
+	XRectangle r;
+
+	xflushbatch();
+
+	/* copy only what was drawn, clipping to the damaged rectangles */
+	if (!XEmptyRegion(xw.damage)) {
+		XClipBox(xw.damage, &r);
+		XSetRegion(xw.dpy, dc.gc, xw.damage);
+		XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, r.x, r.y,
+				r.width, r.height, r.x, r.y);
+		XSetClipMask(xw.dpy, dc.gc, None);
+		XDestroyRegion(xw.damage);
+		xw.damage = XCreateRegion();
+	}
 	XSetForeground(xw.dpy, dc.gc,
 			dc.col[IS_SET(MODE_REVERSE)?
 				defaultfg : defaultbg].pixel);
+	pthread_mutex_unlock(&drawlock);
 }
 
 void
@@ -1749,9 +2630,12 @@ void
 xsetmode(int set, unsigned int flags)
 {
 	int mode = win.mode;
+
+	pthread_mutex_lock(&drawlock);
 	MODBIT(win.mode, set, flags);
+	pthread_mutex_unlock(&drawlock);
 	if ((win.mode & MODE_REVERSE) != (mode & MODE_REVERSE))
-		redraw();
+		tfulldirt();
 }
 
 int
@@ -1759,7 +2643,9 @@ xsetcursor(int cursor)
 {
 	if (!BETWEEN(cursor, 0, 8)) /* 7-8: st extensions */
 		return 1;
+	pthread_mutex_lock(&drawlock);
 	win.cursor = cursor;
+	pthread_mutex_unlock(&drawlock);
 	cursorblinks = win.cursor == 0 || win.cursor == 1 ||
 	               win.cursor == 3 || win.cursor == 5 ||
 	               win.cursor == 7;
@@ -1852,6 +2738,34 @@ kmap(KeySym k, uint state)
 	return NULL;
 }
 
+/* Edit the query of the search or move between the matches. */
+void
+searchkey(KeySym k, const char *buf, int len)
+{
+	switch (k) {
+	case XK_Escape:
+		searchend(0);
+		break;
+	case XK_Return:
+	case XK_KP_Enter:
+		searchend(1);
+		break;
+	case XK_BackSpace:
+		searchdel();
+		break;
+	case XK_Up:
+		searchnext(1);
+		break;
+	case XK_Down:
+		searchnext(-1);
+		break;
+	default:
+		if (len > 0 && (uchar)buf[0] >= ' ' && buf[0] != 0x7f)
+			searchput(buf, len);
+		break;
+	}
+}
+
 void
 kpress(XEvent *ev)
 {
@@ -1862,10 +2776,17 @@ kpress(XEvent *ev)
 	Rune c;
 	Status status;
 	Shortcut *bp;
+	struct timespec now;
 
 	if (IS_SET(MODE_KBDLOCK))
 		return;
 
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (stats.keyed != 1 || TIMEDIFF(now, stats.keyt) > 1000) {
+		stats.keyt = now;
+		stats.keyed = 1;
+	}
+
 	if (xw.ime.xic) {
 		len = XmbLookupString(xw.ime.xic, e, buf, sizeof buf, &ksym, &status);
 		if (status == XBufferOverflow)
@@ -1881,13 +2802,19 @@ kpress(XEvent *ev)
 		}
 	}
 
-	/* 2. custom keys from config.h */
+	/* 2. the query of the search */
+	if (searching()) {
+		searchkey(ksym, buf, len);
+		return;
+	}
+
+	/* 3. custom keys from config.h */
 	if ((customkey = kmap(ksym, e->state))) {
 		ttywrite(customkey, strlen(customkey), 1);
 		return;
 	}
 
-	/* 3. composed string from input method */
+	/* 4. composed string from input method */
 	if (len == 0)
 		return;
 	if (len == 1 && e->state & Mod1Mask) {
@@ -1934,15 +2861,149 @@ resize(XEvent *e)
 	cresize(e->xconfigure.width, e->xconfigure.height);
 }
 
+void
+histadd(Hist *h, double ms)
+{
+	int i;
+
+	for (i = 0; i < HISTBUCKETS - 1 && ms * 1E3 >= 1 << i; i++)
+		;
+	h->bucket[i]++;
+	h->n++;
+	h->sum += ms;
+	h->max = MAX(h->max, ms);
+}
+
+void
+statsdump(void)
+{
+	Hist *hs[] = { &stats.key, &stats.parse, &stats.draw }, *h;
+	char *path = getenv("ST_STATS");
+	FILE *fp = stderr;
+	int i, j;
+
+	if (path && !(fp = fopen(path, "a"))) {
+		fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+		return;
+	}
+	ttystats(fp);
+	fprintf(fp, "output pauses %.3f ms on average\n", stats.gap);
+	for (i = 0; i < LEN(hs); i++) {
+		h = hs[i];
+		fprintf(fp, "%s: %lu, %.3f ms on average, %.3f ms at most\n",
+		        h->name, h->n, h->n ? h->sum / h->n : 0, h->max);
+		for (j = 0; j < HISTBUCKETS - 1; j++) {
+			if (h->bucket[j])
+				fprintf(fp, "\tunder %10.3f ms: %lu\n",
+				        (1 << j) / 1E3, h->bucket[j]);
+		}
+		if (h->bucket[j])
+			fprintf(fp, "\tover  %10.3f ms: %lu\n",
+			        (1 << (j - 1)) / 1E3, h->bucket[j]);
+	}
+	if (fp != stderr)
+		fclose(fp);
+}
+
+void
+usr1(int sig)
+{
+	stats.dump = 1;
+}
+
+/*
+ * Print the time the phase of the start which ends took, with ST_DEBUG
+ * set. Without a phase, start again.
+ */
+void
+timephase(const char *name)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!name)
+		tstart = now;
+	else if (getenv("ST_DEBUG"))
+		fprintf(stderr, "st: %-8s %8.3f ms, %8.3f ms since start\n",
+		        name, TIMEDIFF(now, tphase), TIMEDIFF(now, tstart));
+	tphase = now;
+}
+
+/* ttyread(), timing it and the pause in the output before it */
+void
+ttyreadstat(void)
+{
+	struct timespec t0, t1;
+	double gap;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	ttyread();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	histadd(&stats.parse, TIMEDIFF(t1, t0));
+	if ((gap = TIMEDIFF(t0, stats.lastin)) < maxlatency)
+		stats.gap += (gap - stats.gap) / 8;
+	stats.lastin = t1;
+	if (stats.keyed)
+		stats.keyed = 2;
+}
+
+void *
+parser(void *unused)
+{
+	struct timeval tv;
+	fd_set rfd;
+
+	for (;;) {
+		FD_ZERO(&rfd);
+		FD_SET(pt.ttyfd, &rfd);
+		if (select(pt.ttyfd+1, &rfd, NULL, NULL, NULL) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("select failed: %s\n", strerror(errno));
+		}
+
+		tlock();
+		/* the main thread might have read it in ttywrite() */
+		tv = (struct timeval){ 0 };
+		if (select(pt.ttyfd+1, &rfd, NULL, NULL, &tv) > 0) {
+			ttyreadstat();
+			if (!pt.woken && write(pt.fd[1], "", 1) == 1)
+				pt.woken = 1;
+		}
+		tunlock();
+	}
+
+	return NULL;
+}
+
+void
+parserstart(int ttyfd)
+{
+	pthread_t thread;
+
+	pt.ttyfd = ttyfd;
+	if (pipe(pt.fd) < 0)
+		die("pipe failed: %s\n", strerror(errno));
+	fcntl(pt.fd[0], F_SETFL, O_NONBLOCK);
+	fcntl(pt.fd[1], F_SETFL, O_NONBLOCK);
+
+	if (pthread_create(&thread, NULL, parser, NULL))
+		die("pthread_create failed\n");
+	pthread_detach(thread);
+}
+
 void
 run(void)
 {
 	XEvent ev;
 	int w = win.w, h = win.h;
-	fd_set rfd;
-	int xfd = XConnectionNumber(xw.dpy), ttyfd, xev, drawing;
-	struct timespec seltv, *tv, now, lastblink, trigger;
-	double timeout;
+	fd_set rfd, wfd;
+	int xfd = XConnectionNumber(xw.dpy), ttyfd, xev, drawing, ttyin;
+	int keyshown, ttyout = 0, painted = 0;
+	char buf[64];
+	struct timespec seltv, *tv, now, prev, lastblink, trigger, drawn;
+	double timeout, idle;
+	sigset_t set, unblocked;
 
 	/* Waiting for window mapping */
 	do {
@@ -1959,14 +3020,38 @@ run(void)
 			h = ev.xconfigure.height;
 		}
 	} while (ev.type != MapNotify);
+	timephase("map");
 
 	ttyfd = ttynew(opt_line, shell, opt_io, opt_cmd);
+	timephase("tty");
+
+	/*
+	 * SIGUSR1 is taken only in pselect, which it interrupts; the threads
+	 * started from here on keep it blocked
+	 */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, &unblocked);
+	sigdelset(&unblocked, SIGUSR1);
+	signal(SIGUSR1, usr1);
+
 	cresize(w, h);
+	fontprewarm();
+	stats.gap = minlatency / 2;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (parsethread)
+		parserstart(ttyfd);
 
 	for (timeout = -1, drawing = 0, lastblink = (struct timespec){0};;) {
 		FD_ZERO(&rfd);
-		FD_SET(ttyfd, &rfd);
+		FD_SET(parsethread ? pt.fd[0] : ttyfd, &rfd);
 		FD_SET(xfd, &rfd);
+		if (fw.fd[0] >= 0)
+			FD_SET(fw.fd[0], &rfd);
+		/* a paste the tty did not take at once */
+		FD_ZERO(&wfd);
+		if (ttyout)
+			FD_SET(ttyfd, &wfd);
 
 		if (XPending(xw.dpy))
 			timeout = 0;  /* existing events might not set xfd */
@@ -1975,15 +3060,36 @@ run(void)
 		seltv.tv_nsec = 1E6 * (timeout - 1E3 * seltv.tv_sec);
 		tv = timeout >= 0 ? &seltv : NULL;
 
-		if (pselect(MAX(xfd, ttyfd)+1, &rfd, NULL, NULL, tv, NULL) < 0) {
-			if (errno == EINTR)
-				continue;
-			die("select failed: %s\n", strerror(errno));
+		if (pselect(MAX(MAX(xfd, ttyfd), MAX(fw.fd[0], pt.fd[0]))+1,
+		            &rfd, &wfd, NULL, tv, &unblocked) < 0) {
+			if (errno != EINTR)
+				die("select failed: %s\n", strerror(errno));
+			if (stats.dump) {
+				stats.dump = 0;
+				tlock();
+				statsdump();
+				tunlock();
+			}
+			continue;
 		}
+		prev = now;
 		clock_gettime(CLOCK_MONOTONIC, &now);
 
-		if (FD_ISSET(ttyfd, &rfd))
-			ttyread();
+		tlock();
+		if (parsethread) {
+			/* the parser thread changed the terminal */
+			if ((ttyin = FD_ISSET(pt.fd[0], &rfd))) {
+				while (read(pt.fd[0], buf, sizeof(buf)) > 0)
+					;
+				pt.woken = 0;
+			}
+		} else if ((ttyin = FD_ISSET(ttyfd, &rfd))) {
+			ttyreadstat();
+		}
+
+		/* fallback fonts found, draw the glyphs missing so far */
+		if (fw.fd[0] >= 0 && FD_ISSET(fw.fd[0], &rfd) && fontready())
+			redraw();
 
 		xev = 0;
 		while (XPending(xw.dpy)) {
@@ -1994,6 +3100,17 @@ run(void)
 			if (handler[ev.type])
 				(handler[ev.type])(&ev);
 		}
+		ttyout = ttyflush() > 0;
+
+		/* only the tty took more, keep waiting as before */
+		if (!ttyin && !xev && FD_ISSET(ttyfd, &wfd) && timeout != 0) {
+			if (timeout > 0)
+				timeout = MAX(timeout - TIMEDIFF(now, prev), 0);
+			if (timeout != 0) {
+				tunlock();
+				continue;
+			}
+		}
 
 		/*
 		 * To reduce flicker and tearing, when new content or event
@@ -2005,8 +3122,10 @@ run(void)
 		 * Typically this results in low latency while interacting,
 		 * maximum latency intervals during `cat huge.txt`, and perfect
 		 * sync with periodic updates from animations/key-repeats/etc.
+		 * The idle period waited for is twice the usual pause in the
+		 * output, from minlatency/8 to minlatency.
 		 */
-		if (FD_ISSET(ttyfd, &rfd) || xev) {
+		if (ttyin || xev) {
 			if (!drawing) {
 				trigger = now;
 				if (IS_SET(MODE_BLINK)) {
@@ -2015,52 +3134,64 @@ run(void)
 				lastblink = now;
 				drawing = 1;
 			}
+			idle = MIN(MAX(2 * stats.gap, minlatency / 8), minlatency);
 			timeout = (maxlatency - TIMEDIFF(now, trigger)) \
-			          / maxlatency * minlatency;
-			if (timeout > 0)
+			          / maxlatency * idle;
+			if (timeout > 0) {
+				tunlock();
 				continue;  /* we have time, try to find idle */
+			}
 		}
 
 		/* idle detected or maxlatency exhausted -> draw */
 		timeout = -1;
-		if (blinktimeout && (cursorblinks || tattrset(ATTR_BLINK))) {
+		if (blinktimeout && (cursorblinks || tblinking())) {
 			timeout = blinktimeout - TIMEDIFF(now, lastblink);
 			if (timeout <= 0) {
 				if (-timeout > blinktimeout) /* start visible */
 					win.mode |= MODE_BLINK;
 				win.mode ^= MODE_BLINK;
-				tsetdirtattr(ATTR_BLINK);
+				tsetdirtblink();
 				lastblink = now;
 				timeout = blinktimeout;
 			}
 		}
+		keyshown = stats.keyed == 2;
+		if (keyshown)
+			stats.keyed = 0;
+		tunlock();
 
+		clock_gettime(CLOCK_MONOTONIC, &now);
 		draw();
 		XFlush(xw.dpy);
 		drawing = 0;
+		clock_gettime(CLOCK_MONOTONIC, &drawn);
+		if (!painted) {
+			painted = 1;
+			timephase("frame");
+		}
+		histadd(&stats.draw, TIMEDIFF(drawn, now));
+		if (keyshown)
+			histadd(&stats.key, TIMEDIFF(drawn, stats.keyt));
 	}
 }
 
 void
 usage(void)
 {
-	die("usage: %s [-aiv] [-c class] [-f font] [-g geometry]"
+	die("usage: %s [-adiv] [-c class] [-f font] [-g geometry]"
 	    " [-n name] [-o file]\n"
-	    "          [-T title] [-t title] [-w windowid]"
+	    "          [-s lines] [-T title] [-t title] [-w windowid]"
 	    " [[-e] command [args ...]]\n"
-	    "       %s [-aiv] [-c class] [-f font] [-g geometry]"
+	    "       %s [-adiv] [-c class] [-f font] [-g geometry]"
 	    " [-n name] [-o file]\n"
-	    "          [-T title] [-t title] [-w windowid] -l line"
-	    " [stty_args ...]\n", argv0, argv0);
+	    "          [-s lines] [-T title] [-t title] [-w windowid]"
+	    " -l line [stty_args ...]\n", argv0, argv0);
 }
 
-int
-main(int argc, char *argv[])
+void
+opts(int argc, char *argv[])
 {
-	xw.l = xw.t = 0;
-	xw.isfixed = False;
-	xsetcursor(cursorstyle);
-
 	ARGBEGIN {
 	case 'a':
 		allowaltscreen = 0;
@@ -2068,6 +3199,9 @@ main(int argc, char *argv[])
 	case 'c':
 		opt_class = EARGF(usage());
 		break;
+	case 'd':
+		opt_daemon = 1;
+		break;
 	case 'e':
 		if (argc > 0)
 			--argc, ++argv;
@@ -2091,6 +3225,9 @@ main(int argc, char *argv[])
 	case 'n':
 		opt_name = EARGF(usage());
 		break;
+	case 's':
+		histsize = strtoul(EARGF(usage()), NULL, 10);
+		break;
 	case 't':
 	case 'T':
 		opt_title = EARGF(usage());
@@ -2108,15 +3245,280 @@ main(int argc, char *argv[])
 run:
 	if (argc > 0) /* eat all remaining arguments */
 		opt_cmd = argv;
+}
+
+/* Put the path of the socket of the server for $DISPLAY in sa. */
+int
+sockpath(struct sockaddr_un *sa)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR"), *dpy = getenv("DISPLAY");
+	int n;
+
+	memset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	if (!dpy)
+		return -1;
+	if (dir) {
+		n = snprintf(sa->sun_path, sizeof(sa->sun_path), "%s/st-%s",
+		             dir, dpy);
+	} else {
+		/* only right in /tmp, where others can't replace it */
+		if (strchr(dpy, '/'))
+			return -1;
+		n = snprintf(sa->sun_path, sizeof(sa->sun_path), "/tmp/st-%d-%s",
+		             (int)getuid(), dpy);
+	}
+	return n < sizeof(sa->sun_path) ? 0 : -1;
+}
+
+/*
+ * Load the fonts and serve the windows asked for on the socket. Each
+ * one is a child forked with the fonts loaded here, which only opens
+ * its own connection to the display. Return in the child, with the
+ * options of the request on top of those of the server.
+ */
+void
+serve(void)
+{
+	struct sockaddr_un sa;
+	char **argv;
+	int fd, c, argc;
+	mode_t mask;
+
+	if (sockpath(&sa) < 0)
+		die("no socket path for the display\n");
+
+	if (parsethread && !XInitThreads())
+		die("XInitThreads failed\n");
+	setlocale(LC_CTYPE, "");
+	XSetLocaleModifiers("");
+	if (!(xw.dpy = XOpenDisplay(NULL)))
+		die("can't open display\n");
+	xw.scr = XDefaultScreen(xw.dpy);
+	if (!FcInit())
+		die("could not init fontconfig.\n");
+	usedfont = (opt_font == NULL)? font : opt_font;
+	xloadfonts(usedfont, 0);
+	fontsort();
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		die("socket failed: %s\n", strerror(errno));
+	/* connecting takes write permission on it */
+	mask = umask(077);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		c = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (errno != EADDRINUSE || c < 0 ||
+		    !connect(c, (struct sockaddr *)&sa, sizeof(sa)))
+			die("can't bind %s\n", sa.sun_path);
+		/* left by a server which is gone */
+		close(c);
+		unlink(sa.sun_path);
+		if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+			die("bind %s failed: %s\n", sa.sun_path, strerror(errno));
+	}
+	umask(mask);
+	if (listen(fd, 16) < 0)
+		die("listen failed: %s\n", strerror(errno));
+
+	/* the windows are not waited for */
+	signal(SIGCHLD, SIG_IGN);
+	for (;;) {
+		if ((c = accept(fd, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			die("accept failed: %s\n", strerror(errno));
+		}
+		switch (fork()) {
+		case -1:
+			fprintf(stderr, "fork failed: %s\n", strerror(errno));
+			break;
+		case 0:
+			close(fd);
+			close(ConnectionNumber(xw.dpy));
+			signal(SIGCHLD, SIG_DFL);
+			/* the client waits for it to be closed */
+			fcntl(c, F_SETFD, FD_CLOEXEC);
+			timephase(NULL);
+			argv = request(c, &argc);
+			opt_daemon = 0;
+			opts(argc, argv);
+			return;
+		}
+		close(c);
+	}
+}
+
+/*
+ * Read the request of a client on c: the arguments, returned, and the
+ * working directory, the environment and the standard files, which
+ * become those of this process.
+ */
+char **
+request(int c, int *argc)
+{
+	extern char **environ;
+	uint32_t hdr[2];
+	char cbuf[CMSG_SPACE(3 * sizeof(int))], *buf, *p, **v;
+	struct iovec iov = { hdr, sizeof(hdr) };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof(cbuf)
+	};
+	struct cmsghdr *cm;
+	int fds[3], i, n;
+	size_t off;
+	ssize_t r;
+
+	if (recvmsg(c, &msg, MSG_WAITALL) != sizeof(hdr) ||
+	    !(cm = CMSG_FIRSTHDR(&msg)) || cm->cmsg_type != SCM_RIGHTS ||
+	    cm->cmsg_len != CMSG_LEN(sizeof(fds)))
+		die("bad request\n");
+	memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+	for (i = 0; i < 3; i++) {
+		if (fds[i] != i) {
+			dup2(fds[i], i);
+			close(fds[i]);
+		}
+	}
+
+	buf = xmalloc(hdr[0] + 1);
+	for (off = 0; off < hdr[0]; off += r) {
+		if ((r = read(c, buf + off, hdr[0] - off)) < 0 && errno == EINTR)
+			r = 0;
+		else if (r <= 0)
+			die("bad request\n");
+	}
+	buf[hdr[0]] = '\0';
+	for (p = buf, n = 0; p < buf + hdr[0]; p += strlen(p) + 1)
+		n++;
+	if (hdr[1] < 1 || hdr[1] >= n)
+		die("bad request\n");
+
+	/* the directory, the arguments and the environment */
+	if (chdir(buf) < 0)
+		fprintf(stderr, "chdir %s: %s\n", buf, strerror(errno));
+	v = xmalloc((n + 1) * sizeof(*v));
+	p = buf + strlen(buf) + 1;
+	for (i = 0; i < n; i++) {
+		if (i == hdr[1]) {
+			v[i] = NULL;
+		} else {
+			v[i] = p;
+			p += strlen(p) + 1;
+		}
+	}
+	v[n] = NULL;
+	environ = v + hdr[1] + 1;
+	*argc = hdr[1];
+
+	return v;
+}
+
+/*
+ * Ask the server for the window, if there is one. The arguments, the
+ * working directory, the environment and the standard files go with the
+ * request. Exit when the server closes the connection, as the window is.
+ */
+void
+client(int argc, char *argv[])
+{
+	extern char **environ;
+	struct sockaddr_un sa;
+	char cwd[PATH_MAX], cbuf[CMSG_SPACE(3 * sizeof(int))], *buf, **e;
+	uint32_t hdr[2];
+	struct iovec iov = { hdr, sizeof(hdr) };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof(cbuf)
+	};
+	struct cmsghdr *cm;
+	struct stat st;
+	int fd, fds[3] = { 0, 1, 2 }, i;
+	size_t len, off;
+	ssize_t r;
+
+	/* the environment and the files go only to a server of this user */
+	if (sockpath(&sa) < 0 || lstat(sa.sun_path, &st) < 0 ||
+	    !S_ISSOCK(st.st_mode) || st.st_uid != getuid())
+		return;
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return;
+	/* fd is a closed standard file, which would be sent as itself */
+	if (fd <= 2 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		close(fd);
+		return;
+	}
+
+	if (!getcwd(cwd, sizeof(cwd)))
+		strcpy(cwd, "/");
+	len = strlen(cwd) + 1;
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	for (e = environ; *e; e++)
+		len += strlen(*e) + 1;
+	buf = xmalloc(len);
+	off = 0;
+	off += sprintf(buf + off, "%s", cwd) + 1;
+	for (i = 0; i < argc; i++)
+		off += sprintf(buf + off, "%s", argv[i]) + 1;
+	for (e = environ; *e; e++)
+		off += sprintf(buf + off, "%s", *e) + 1;
+
+	hdr[0] = len;
+	hdr[1] = argc;
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+	/* run without the server if it can't be asked, as for a closed stdin */
+	if (sendmsg(fd, &msg, 0) != sizeof(hdr)) {
+		close(fd);
+		free(buf);
+		return;
+	}
+	for (off = 0; off < len; off += r) {
+		if ((r = write(fd, buf + off, len - off)) < 0) {
+			if (errno != EINTR) {
+				close(fd);
+				free(buf);
+				return;
+			}
+			r = 0;
+		}
+	}
+
+	while ((r = read(fd, cwd, sizeof(cwd))) > 0 ||
+	       (r < 0 && errno == EINTR))
+		;
+	exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	timephase(NULL);
+	xw.l = xw.t = 0;
+	xw.isfixed = False;
+	xsetcursor(cursorstyle);
+
+	opts(argc, argv);
+	if (opt_daemon)
+		serve();
+	else
+		client(argc, argv);
 
 	if (!opt_title)
 		opt_title = (opt_line || !opt_cmd) ? "st" : opt_cmd[0];
 
+	if (parsethread && !XInitThreads())
+		die("XInitThreads failed\n");
 	setlocale(LC_CTYPE, "");
 	XSetLocaleModifiers("");
 	cols = MAX(cols, 1);
 	rows = MAX(rows, 1);
 	tnew(cols, rows);
+	timephase("terminal");
 	xinit(cols, rows);
 	xsetenv();
 	selinit();